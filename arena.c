@@ -0,0 +1,50 @@
+// arena.c - Bump allocator for objects that share one lifetime
+#include "lawsa.h"
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+
+struct ArenaChunk
+{
+    ArenaChunk *next; // Previously filled chunk
+    size_t used;      // Bytes handed out from data[]
+    size_t cap;       // Capacity of data[]
+    _Alignas(ARENA_ALIGN) char data[];
+};
+
+// Returns zero-initialized memory that lives until arena_release().
+// Requests larger than a chunk get a dedicated chunk of their own.
+void *arena_alloc(Arena *a, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    ArenaChunk *c = a->head;
+    if (!c || c->cap - c->used < size)
+    {
+        size_t cap = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        c = calloc(1, sizeof(ArenaChunk) + cap);
+        if (!c)
+        {
+            fprintf(stderr, "arena: out of memory\n");
+            exit(1);
+        }
+        c->cap = cap;
+        c->next = a->head;
+        a->head = c;
+    }
+    void *p = c->data + c->used;
+    c->used += size;
+    return p;
+}
+
+// Frees every object allocated from the arena in one pass over its chunks.
+void arena_release(Arena *a)
+{
+    ArenaChunk *c = a->head;
+    while (c)
+    {
+        ArenaChunk *next = c->next;
+        free(c);
+        c = next;
+    }
+    a->head = NULL;
+}
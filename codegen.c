@@ -937,6 +937,7 @@ static void peephole_optimize_and_output()
     }
     // Third pass: remove unused labels (labels not referenced)
     int used[MAX_ASM_LINES] = {0};
+    int output_count = 0;
     for (i = 0; i < cleaned_count; i++)
     {
         if (cleaned[i][0] == '.')
@@ -957,7 +958,10 @@ static void peephole_optimize_and_output()
                 continue;
         }
         puts(cleaned[i]);
+        output_count++;
     }
+    TRACE(TRACE_PEEPHOLE, 1, "%d lines in, %d after merging stack adjustments, %d out",
+          asm_line_count, merged_count, output_count);
     asm_line_count = 0;
 }
 
@@ -965,18 +969,18 @@ static void peephole_optimize_and_output()
 void codegen(Function *prog)
 {
     // Print out the assembly header
-    fprintf(stderr, "[DEBUG] Entering codegen for function: %.*s\n", prog->len, prog->name);
+    TRACE(TRACE_CODEGEN, 1, "entering codegen for function: %.*s", prog->len, prog->name);
     emit(".intel_syntax noprefix");
 
     // Generate code for each function
     for (Function *fn = prog; fn; fn = fn->next)
     {
-        fprintf(stderr, "[DEBUG] Generating code for function: %.*s\n", fn->len, fn->name);
+        TRACE(TRACE_CODEGEN, 1, "generating code for function: %.*s", fn->len, fn->name);
         // Print the function name with .global directive
         emit(".global %.*s", fn->len, fn->name);
         gen_function(fn);
     }
 
     peephole_optimize_and_output();
-    fprintf(stderr, "Assembly generation complete\n");
+    TRACE(TRACE_CODEGEN, 1, "assembly generation complete");
 }
\ No newline at end of file
@@ -0,0 +1,122 @@
+// embed_headers.c - Build-time generator for builtin_headers.c
+//
+// Writes a C source file to stdout that holds the text of each header named
+// on the command line as a string constant, for the include cache to serve
+// without touching the file system. With --images, each header's
+// precompiled image (NAME.lpch, made by header_image) goes in as well.
+// Run by the Makefile; see include.c and pch.c.
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Writes one header's text as a sequence of string literals, a line each
+static long write_text(FILE *in)
+{
+    long len = 0;
+    int c;
+    bool open = false;
+    while ((c = fgetc(in)) != EOF)
+    {
+        if (!open)
+        {
+            fputs("        \"", stdout);
+            open = true;
+        }
+        len++;
+        if (c == '\n')
+        {
+            fputs("\\n\"\n", stdout);
+            open = false;
+        }
+        else if (c == '"' || c == '\\' || c == '?') // '?' so no trigraph forms
+            printf("\\%c", c);
+        else if (c < ' ' || c > '~')
+            printf("\\%03o", c);
+        else
+            putchar(c);
+    }
+    if (open)
+        fputs("\"\n", stdout);
+    if (!len)
+        fputs("        \"\"\n", stdout);
+    return len;
+}
+
+// Writes the bytes of an image as a sequence of string literals
+static void write_bytes(FILE *in)
+{
+    int c, col = 0;
+    while ((c = fgetc(in)) != EOF)
+    {
+        if (col == 0)
+            fputs("    \"", stdout);
+        if (c >= ' ' && c <= '~' && c != '"' && c != '\\' && c != '?')
+            putchar(c);
+        else
+            printf("\\%03o", c);
+        if (++col == 32)
+        {
+            fputs("\"\n", stdout);
+            col = 0;
+        }
+    }
+    if (col)
+        fputs("\"\n", stdout);
+}
+
+// Returns the image file of a header, its name with .lpch for .h
+static char *image_path(const char *header)
+{
+    size_t len = strlen(header);
+    if (len > 2 && !strcmp(header + len - 2, ".h"))
+        len -= 2;
+    char *path = malloc(len + sizeof(".lpch"));
+    memcpy(path, header, len);
+    strcpy(path + len, ".lpch");
+    return path;
+}
+
+int main(int argc, char **argv)
+{
+    bool images = argc > 1 && !strcmp(argv[1], "--images");
+    int first = images ? 2 : 1;
+    printf("// Generated by embed_headers; do not edit\n");
+    printf("#include \"lawsa.h\"\n\n");
+    // Aligned like the image files' sections, which pch.c reads in place
+    for (int i = first; images && i < argc; i++)
+    {
+        char *path = image_path(argv[i]);
+        FILE *in = fopen(path, "rb");
+        if (!in)
+        {
+            fprintf(stderr, "embed_headers: cannot open %s\n", path);
+            return 1;
+        }
+        printf("_Alignas(8) static const unsigned char image%d[] =\n", i);
+        write_bytes(in);
+        printf("    ;\n\n");
+        fclose(in);
+        free(path);
+    }
+    printf("const BuiltinHeader builtin_headers[] = {\n");
+    for (int i = first; i < argc; i++)
+    {
+        FILE *in = fopen(argv[i], "rb");
+        if (!in)
+        {
+            fprintf(stderr, "embed_headers: cannot open %s\n", argv[i]);
+            return 1;
+        }
+        const char *name = strrchr(argv[i], '/');
+        printf("    {\"%s\",\n", name ? name + 1 : argv[i]);
+        long len = write_text(in);
+        if (images)
+            printf("        , %ld, image%d, sizeof(image%d) - 1},\n", len, i, i);
+        else
+            printf("        , %ld, NULL, 0},\n", len);
+        fclose(in);
+    }
+    printf("    {NULL, NULL, 0, NULL, 0},\n};\n");
+    return 0;
+}
@@ -0,0 +1,70 @@
+// header_image.c - Build-time generator of the built-in headers' images
+//
+// "header_image stdio.h stdio.lpch" includes the built-in <stdio.h> the way
+// a program would, parses it, and writes a precompiled image of it along
+// with what the preprocessor did with macros on the way (see pch.c). It
+// links against builtin_text.c, the headers' texts without their images;
+// embed_headers then compiles the images into lawsa next to the texts. Run
+// by the Makefile.
+#include "lawsa.h"
+#include "preprocess.h"
+
+char *user_input;
+Token *token;
+static int error_count;
+
+void error(char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+    error_count++;
+}
+
+void error_at(Token *tok, char *fmt, ...)
+{
+    if (!tok)
+        fprintf(stderr, "<unknown location>: error: ");
+    else
+    {
+        int line, column;
+        token_position(tok, &line, &column);
+        fprintf(stderr, "%s:%d:%d: error: ", source_file_name(tok->file_id), line, column);
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+    error_count++;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: header_image HEADER IMAGE\n");
+        return 1;
+    }
+    const char *name = strrchr(argv[1], '/');
+    name = name ? name + 1 : argv[1];
+    char input[256];
+    if (snprintf(input, sizeof(input), "#include <%s>\n", name) >= (int)sizeof(input))
+    {
+        fprintf(stderr, "header_image: name too long: %s\n", name);
+        return 1;
+    }
+    user_input = input;
+    pch_watch_macros();
+    token = preprocess_tokens("<image>", input, true);
+    Token *tokens = token;
+    parse_program();
+    if (error_count || !pch_write(argv[2], tokens))
+    {
+        remove(argv[2]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,394 @@
+// include.c - Cache of included files
+//
+// Each header is mapped once per process and remembered both by the path it
+// was named by and by device and inode, so different spellings of one file
+// share an entry. When a file is first loaded it is checked for the
+// multiple-include idiom, where everything but comments sits inside
+// "#ifndef X / #define X ... #endif". The preprocessor skips a re-inclusion
+// without I/O or rescanning when that guard macro is still defined, or when
+// the file said "#pragma once". The files are also remembered in the order
+// they were loaded, for writing dependency rules (-MD).
+//
+// Names are resolved against the includer's directory (for "..." only),
+// the -I directories, the -isystem directories, the standard headers built
+// into the binary and finally the working directory. Whether each candidate
+// path exists is remembered, misses included, so a header named again costs
+// hash probes rather than failed opens in every directory before the one
+// holding it. Built-in headers are named "<builtin>/NAME" and are served
+// from memory.
+#include "lawsa.h"
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+// Entries are found by interned path, and by file identity through an
+// open-addressing table that holds at most half its slots.
+typedef struct
+{
+    const char *path; // Interned spelling
+    IncludeFile *file;
+} PathSlot;
+
+static PtrTable by_path = PTR_TABLE(PathSlot);
+static IncludeFile **by_id;
+static uint32_t id_cap; // Power of two
+static uint32_t id_count;
+
+// Every file loaded, in order
+static IncludeFile **loaded;
+static int loaded_count;
+static int loaded_cap;
+
+// Search directories, -I ones first
+static const char **search_dirs;
+static int search_count;
+static int search_user; // Number of -I directories at the front
+static int search_cap;
+
+#define BUILTIN_DIR "<builtin>"
+#define BUILTIN_PREFIX_LEN (sizeof(BUILTIN_DIR "/") - 1)
+
+// Known candidate paths, keyed by interned path
+typedef struct
+{
+    const char *path;
+    bool exists;
+} StatSlot;
+
+static PtrTable stat_cache = PTR_TABLE(StatSlot);
+
+static uint32_t id_slot(IncludeFile **slots, uint64_t dev, uint64_t ino)
+{
+    uint32_t mask = id_cap - 1;
+    uint32_t i = (uint32_t)((dev * 31 + ino) * 2654435761u) & mask;
+    while (slots[i] && (slots[i]->dev != dev || slots[i]->ino != ino))
+        i = (i + 1) & mask;
+    return i;
+}
+
+static void id_grow(void)
+{
+    IncludeFile **old = by_id;
+    uint32_t old_cap = id_cap;
+    id_cap = old_cap ? old_cap * 2 : 64;
+    by_id = calloc(id_cap, sizeof(IncludeFile *));
+    for (uint32_t i = 0; i < old_cap; i++)
+        if (old[i])
+            by_id[id_slot(by_id, old[i]->dev, old[i]->ino)] = old[i];
+    free(old);
+}
+
+// Skips blanks, newlines and comments
+static const char *skip_blank(const char *p)
+{
+    for (;;)
+    {
+        p = scan_skip_space(p);
+        if (p[0] == '/' && p[1] == '/')
+            p = scan_line_end(p + 2);
+        else if (p[0] == '/' && p[1] == '*')
+            p = scan_comment_end(p + 2);
+        else
+            return p;
+    }
+}
+
+// Reads the directive at p, just past '#', into its name and first word
+static const char *read_directive(const char *p, const char **name, int *name_len,
+                                  const char **arg, int *arg_len)
+{
+    while (*p == ' ' || *p == '\t')
+        p++;
+    *name = p;
+    p = scan_ident_end(p);
+    *name_len = p - *name;
+    while (*p == ' ' || *p == '\t')
+        p++;
+    *arg = p;
+    p = scan_ident_end(p);
+    *arg_len = p - *arg;
+    return scan_line_end(p);
+}
+
+#define IS_DIRECTIVE(name, len, word) ((len) == (int)sizeof(word) - 1 && !memcmp(name, word, len))
+
+// Returns the interned guard macro when the whole text is wrapped in an
+// #ifndef / #define pair and its matching #endif, otherwise NULL
+static const char *detect_guard(const char *p)
+{
+    const char *guard = NULL;
+    int depth = 0;
+    bool closed = false;
+    for (p = skip_blank(p); *p; p = skip_blank(p))
+    {
+        if (closed || *p != '#')
+        {
+            // Code before the guard or after its #endif
+            if (!depth)
+                return NULL;
+            p = scan_line_end(p);
+            continue;
+        }
+        const char *name, *arg;
+        int name_len, arg_len;
+        p = read_directive(p + 1, &name, &name_len, &arg, &arg_len);
+        if (!guard)
+        {
+            if (!IS_DIRECTIVE(name, name_len, "ifndef") || !arg_len)
+                return NULL;
+            guard = intern(arg, arg_len);
+            depth = 1;
+            // The guard must be defined straight away
+            p = skip_blank(p);
+            if (*p != '#')
+                return NULL;
+            p = read_directive(p + 1, &name, &name_len, &arg, &arg_len);
+            if (!IS_DIRECTIVE(name, name_len, "define") || intern_find(arg, arg_len) != guard)
+                return NULL;
+            continue;
+        }
+        if (IS_DIRECTIVE(name, name_len, "if") || IS_DIRECTIVE(name, name_len, "ifdef") ||
+            IS_DIRECTIVE(name, name_len, "ifndef"))
+            depth++;
+        else if ((IS_DIRECTIVE(name, name_len, "else") || IS_DIRECTIVE(name, name_len, "elif")) && depth == 1)
+            return NULL;
+        else if (IS_DIRECTIVE(name, name_len, "endif") && --depth == 0)
+            closed = true;
+    }
+    return closed ? guard : NULL;
+}
+
+// Returns the built-in header for a path under BUILTIN_DIR, or NULL
+static const BuiltinHeader *find_builtin(const char *path)
+{
+    if (strncmp(path, BUILTIN_DIR "/", BUILTIN_PREFIX_LEN) != 0)
+        return NULL;
+    for (const BuiltinHeader *h = builtin_headers; h->name; h++)
+        if (!strcmp(h->name, path + BUILTIN_PREFIX_LEN))
+            return h;
+    return NULL;
+}
+
+// Appends f to the files loaded so far
+static void add_loaded(IncludeFile *f)
+{
+    if (loaded_count == loaded_cap)
+    {
+        loaded_cap = loaded_cap ? loaded_cap * 2 : 64;
+        loaded = realloc(loaded, sizeof(IncludeFile *) * loaded_cap);
+    }
+    loaded[loaded_count++] = f;
+}
+
+// Returns the cache entry for path, loading the file on first use, or NULL
+// if it cannot be opened
+IncludeFile *include_open(const char *path)
+{
+    const char *atom = intern(path, strlen(path));
+    PathSlot *known = ptr_table_find(&by_path, atom);
+    if (known)
+        return known->file;
+
+    const BuiltinHeader *h = find_builtin(path);
+    if (h)
+    {
+        // Already NUL-terminated, and never written through
+        IncludeFile *f = calloc(1, sizeof(IncludeFile));
+        f->path = atom;
+        f->text.data = (char *)h->text;
+        f->text.len = h->len;
+        f->builtin = true;
+        f->image = h->image;
+        f->image_len = h->image_len;
+        f->file_id = -1;
+        f->guard = detect_guard(f->text.data);
+        TRACE(TRACE_PP, 1, "loaded built-in %s", h->name);
+        add_loaded(f);
+        ((PathSlot *)ptr_table_put(&by_path, atom, NULL))->file = f;
+        return f;
+    }
+
+    uint64_t dev = 0, ino = 0;
+#ifndef _WIN32
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return NULL;
+    dev = st.st_dev;
+    ino = st.st_ino;
+    if (id_count * 2 >= id_cap)
+        id_grow();
+    uint32_t is = id_slot(by_id, dev, ino);
+    IncludeFile *f = by_id[is];
+    if (!f)
+#else
+    IncludeFile *f = NULL;
+#endif
+    {
+        f = calloc(1, sizeof(IncludeFile));
+        if (!source_open(&f->text, path))
+        {
+            free(f);
+            return NULL;
+        }
+        f->path = atom;
+        f->file_id = -1;
+        f->dev = dev;
+        f->ino = ino;
+        f->guard = detect_guard(f->text.data);
+        TRACE(TRACE_PP, 1, "loaded %s%s%s", path, f->guard ? ", guarded by " : "", f->guard ? f->guard : "");
+        add_loaded(f);
+#ifndef _WIN32
+        by_id[is] = f;
+        id_count++;
+#endif
+    }
+    // Another spelling of a file already loaded gets its own path slot
+    ((PathSlot *)ptr_table_put(&by_path, atom, NULL))->file = f;
+    return f;
+}
+
+// Writes name as a make word, escaping what make would split it on
+static int write_dep_word(FILE *fp, const char *name)
+{
+    int len = 0;
+    for (const char *c = name; *c; c++)
+    {
+        if (*c == ' ' || *c == '\t' || *c == '#')
+            len += fprintf(fp, "\\%c", *c);
+        else if (*c == '$')
+            len += fprintf(fp, "$$");
+        else
+        {
+            fputc(*c, fp);
+            len++;
+        }
+    }
+    return len;
+}
+
+#define DEP_LINE_MAX 76
+
+// Writes a make rule to path saying that target depends on source and on
+// every file loaded so far, each once; built-in headers are left out.
+// Returns false if path cannot be written.
+bool include_write_deps(const char *path, const char *target, const char *source)
+{
+    FILE *fp = fopen(path, "w");
+    if (!fp)
+        return false;
+    int col = write_dep_word(fp, target) + 1;
+    fputc(':', fp);
+    for (int i = -1; i < loaded_count; i++)
+    {
+        if (i >= 0 && loaded[i]->builtin)
+            continue;
+        const char *name = i < 0 ? source : loaded[i]->path;
+        if (!name)
+            continue;
+        int len = (int)strlen(name);
+        if (col + 1 + len > DEP_LINE_MAX && col > 1)
+        {
+            fputs(" \\\n", fp);
+            col = 0;
+        }
+        fputc(' ', fp);
+        col += 1 + write_dep_word(fp, name);
+    }
+    fputc('\n', fp);
+    bool ok = !ferror(fp);
+    ok &= fclose(fp) == 0;
+    return ok;
+}
+
+// Adds a directory to search for included files. -I (user) directories are
+// searched in the order given, ahead of every -isystem (system) one.
+void include_add_dir(const char *dir, bool system)
+{
+    if (search_count == search_cap)
+    {
+        search_cap = search_cap ? search_cap * 2 : 8;
+        search_dirs = realloc(search_dirs, sizeof(char *) * search_cap);
+    }
+    int at = system ? search_count : search_user++;
+    memmove(search_dirs + at + 1, search_dirs + at, sizeof(char *) * (search_count - at));
+    search_dirs[at] = dir;
+    search_count++;
+}
+
+// Returns whether an interned path names a regular file, asking the file
+// system only the first time
+static bool path_exists(const char *path)
+{
+    bool added;
+    StatSlot *slot = ptr_table_put(&stat_cache, path, &added);
+    if (added)
+    {
+        bool exists;
+        if (!strncmp(path, BUILTIN_DIR "/", BUILTIN_PREFIX_LEN))
+        {
+            exists = find_builtin(path) != NULL;
+        }
+        else
+        {
+#ifndef _WIN32
+            struct stat st;
+            exists = stat(path, &st) == 0 && S_ISREG(st.st_mode);
+#else
+            FILE *fp = fopen(path, "rb");
+            exists = fp != NULL;
+            if (fp)
+                fclose(fp);
+#endif
+        }
+        TRACE(TRACE_PP, 2, "looked for %s: %s", path, exists ? "found" : "missing");
+        slot->exists = exists;
+    }
+    return slot->exists;
+}
+
+#define INCLUDE_PATH_MAX 4096
+
+// Returns the interned path of name in dir, the first len bytes of dir, or
+// NULL if it is too long
+static const char *join_path(const char *dir, int len, const char *name)
+{
+    int name_len = (int)strlen(name);
+    if (!len)
+        return intern(name, name_len);
+    char buf[INCLUDE_PATH_MAX];
+    bool slash = dir[len - 1] == '/';
+    int n = snprintf(buf, sizeof(buf), "%.*s%s%s", len, dir, slash ? "" : "/", name);
+    if (n < 0 || n >= (int)sizeof(buf))
+        return NULL;
+    return intern(buf, n);
+}
+
+// Finds the file an #include names and returns its cache entry, or NULL if
+// no search directory holds it. includer is the path of the including file;
+// a quoted name is looked for next to it first.
+IncludeFile *include_find(const char *name, bool angled, const char *includer)
+{
+    if (name[0] == '/')
+    {
+        const char *path = intern(name, strlen(name));
+        return path_exists(path) ? include_open(path) : NULL;
+    }
+    const char *path = NULL;
+    if (!angled && includer)
+    {
+        const char *slash = strrchr(includer, '/');
+        const char *candidate = join_path(includer, slash ? (int)(slash - includer) + 1 : 0, name);
+        if (candidate && path_exists(candidate))
+            path = candidate;
+    }
+    for (int i = 0; !path && i <= search_count + 1; i++)
+    {
+        // Then the built-in headers, and the working directory last
+        const char *dir = i < search_count ? search_dirs[i] : i == search_count ? BUILTIN_DIR : "";
+        const char *candidate = join_path(dir, (int)strlen(dir), name);
+        if (candidate && path_exists(candidate))
+            path = candidate;
+    }
+    return path ? include_open(path) : NULL;
+}
@@ -0,0 +1,80 @@
+// intern.c - Identifier interning
+//
+// Every distinct name maps to one canonical NUL-terminated copy, so symbol
+// tables can compare names by pointer. Interned strings live for the whole
+// process.
+#include "lawsa.h"
+
+typedef struct
+{
+    const char *str; // Interned string, NULL if the slot is empty
+    uint32_t hash;
+    int len;
+} InternSlot;
+
+static InternSlot *intern_slots;
+static uint32_t intern_cap; // Power of two
+static uint32_t intern_count;
+static Arena intern_arena;
+
+// FNV-1a
+uint32_t hash_bytes(const char *s, int len)
+{
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < len; i++)
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
+    return h;
+}
+
+static InternSlot *intern_probe(const char *s, int len, uint32_t hash)
+{
+    uint32_t mask = intern_cap - 1;
+    for (uint32_t i = hash & mask;; i = (i + 1) & mask)
+    {
+        InternSlot *slot = &intern_slots[i];
+        if (!slot->str)
+            return slot;
+        if (slot->hash == hash && slot->len == len && !memcmp(slot->str, s, len))
+            return slot;
+    }
+}
+
+static void intern_grow(void)
+{
+    InternSlot *old = intern_slots;
+    uint32_t old_cap = intern_cap;
+    intern_cap = old_cap ? old_cap * 2 : 1024;
+    intern_slots = calloc(intern_cap, sizeof(InternSlot));
+    for (uint32_t i = 0; i < old_cap; i++)
+        if (old[i].str)
+            *intern_probe(old[i].str, old[i].len, old[i].hash) = old[i];
+    free(old);
+}
+
+// Returns the canonical copy of s[0..len), adding it on first sight
+const char *intern(const char *s, int len)
+{
+    if (intern_count * 2 >= intern_cap)
+        intern_grow();
+    uint32_t hash = hash_bytes(s, len);
+    InternSlot *slot = intern_probe(s, len, hash);
+    if (!slot->str)
+    {
+        char *copy = arena_alloc(&intern_arena, len + 1);
+        memcpy(copy, s, len);
+        slot->str = copy;
+        slot->hash = hash;
+        slot->len = len;
+        intern_count++;
+    }
+    return slot->str;
+}
+
+// Returns the canonical copy of s[0..len) if it has been interned, or NULL.
+// A NULL result means no symbol table can hold that name.
+const char *intern_find(const char *s, int len)
+{
+    if (!intern_cap)
+        return NULL;
+    return intern_probe(s, len, hash_bytes(s, len))->str;
+}
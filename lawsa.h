@@ -7,6 +7,7 @@
 #include <errno.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -25,39 +26,221 @@ typedef enum
     TK_KEYWORD,  // Keywords (if, else, while, for, etc.)
 } TokenKind;
 
+// Keyword IDs, carried in Token::val for TK_KEYWORD tokens
+typedef enum
+{
+    KW_NONE = -1,
+    KW_IF,
+    KW_ELSE,
+    KW_WHILE,
+    KW_FOR,
+    KW_DO,
+    KW_RETURN,
+    KW_VOID,
+    KW_CHAR,
+    KW_SHORT,
+    KW_INT,
+    KW_LONG,
+    KW_FLOAT,
+    KW_DOUBLE,
+    KW_SIGNED,
+    KW_UNSIGNED,
+    KW_CONST,
+    KW_VOLATILE,
+    KW_STRUCT,
+    KW_UNION,
+    KW_ENUM,
+    KW_TYPEDEF,
+    KW_SIZEOF,
+    KW_STATIC,
+    KW_EXTERN,
+    KW_REGISTER,
+    KW_BREAK,
+    KW_CONTINUE,
+    KW_SWITCH,
+    KW_CASE,
+    KW_DEFAULT,
+    KW_GOTO,
+} KeywordKind;
+
 // Token type
+// Tokens are bump-allocated from one arena per token stream and laid out
+// to keep the per-token footprint small; free_tokens() releases the stream.
+// A token's position is its offset into the file text, found through str;
+// token_position() turns that into a line and column.
 typedef struct Token Token;
 struct Token
 {
-    TokenKind kind;   // Token kind
     Token *next;      // Next token
-    int val;          // If kind is TK_NUM, its value
     char *str;        // Token string
+    union
+    {
+        int val;          // TK_NUM: its value; TK_KEYWORD: its KeywordKind
+        const char *name; // TK_IDENT: interned name, see intern()
+    };
     int len;          // Token length
-    const char *file; // File name for error reporting
-    int line;         // Line number for error reporting
-    int column;       // Column number for error reporting
+    uint8_t kind;     // TokenKind
+    uint16_t file_id; // Source file, see source_file_name()
 };
 
+// Bump allocator
+typedef struct ArenaChunk ArenaChunk;
+typedef struct
+{
+    ArenaChunk *head; // Most recently allocated chunk
+} Arena;
+
+void *arena_alloc(Arena *a, size_t size);
+void arena_release(Arena *a);
+
+// Pointer-keyed hash tables (ptrtable.c). Slots are the caller's structs,
+// each starting with its key pointer; declare a table with PTR_TABLE(Slot).
+typedef struct
+{
+    void *slots;
+    uint32_t cap; // Power of two, 0 until the first entry
+    uint32_t count;
+    uint32_t slot_size;
+} PtrTable;
+
+#define PTR_TABLE(slot_type) {.slot_size = sizeof(slot_type)}
+
+uint32_t hash_ptr(const void *p);
+void *ptr_table_find(const PtrTable *t, const void *key);
+void *ptr_table_put(PtrTable *t, const void *key, bool *added);
+void ptr_table_free(PtrTable *t);
+
+// Identifier interning (intern.c)
+uint32_t hash_bytes(const char *s, int len);
+const char *intern(const char *s, int len);
+const char *intern_find(const char *s, int len);
+
+// Debug tracing (trace.c)
+typedef enum
+{
+    TRACE_DRIVER,   // Command line and input handling
+    TRACE_LEX,      // Tokenizer
+    TRACE_PP,       // Preprocessor
+    TRACE_PARSE,    // Parser
+    TRACE_CODEGEN,  // Code generation
+    TRACE_PEEPHOLE, // Peephole optimizer
+    TRACE_NCAT,
+} TraceCategory;
+
+extern int trace_levels[TRACE_NCAT];
+void trace_enable(const char *spec);
+void trace_print(TraceCategory cat, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// TRACE(cat, level, fmt, ...) prints one line when cat is traced at level or
+// above. Arguments are only evaluated then, and release builds (NDEBUG)
+// drop the call entirely.
+#ifdef NDEBUG
+#define TRACE_ON(cat, level) 0
+#define TRACE(cat, level, ...) ((void)0)
+#else
+#define TRACE_ON(cat, level) (trace_levels[cat] >= (level))
+#define TRACE(cat, level, ...) (TRACE_ON(cat, level) ? trace_print(cat, __VA_ARGS__) : (void)0)
+#endif
+
+// Byte classes and run scanners (scan.c)
+#define CC_SPACE 0x01 // \t \n \v \f \r and space
+#define CC_ALPHA 0x02 // A-Z a-z _
+#define CC_DIGIT 0x04 // 0-9
+extern const uint8_t char_class[256];
+
+const char *scan_skip_space(const char *p);
+const char *scan_ident_end(const char *p);
+const char *scan_line_end(const char *p);
+const char *scan_comment_end(const char *p);
+const char *scan_string_end(const char *p);
+
+// Source input buffer (source.c)
+typedef struct
+{
+    char *data;     // Text after any BOM; data[len] is always NUL
+    size_t len;     // Length of the text
+    void *map;      // Base of the file mapping, if mapped
+    size_t map_len; // Length of the mapping
+    char *alloc;    // Heap copy, if the input was read from a stream
+} SourceBuffer;
+
+bool source_open(SourceBuffer *buf, const char *path);
+bool source_read_stream(SourceBuffer *buf, FILE *fp);
+void source_close(SourceBuffer *buf);
+
+// Include cache (include.c)
+typedef struct
+{
+    const char *path;  // Interned path the file was first opened by
+    SourceBuffer text; // Mapped contents, kept for the whole process
+    const char *guard; // Interned include-guard macro, or NULL
+    bool once;         // Said #pragma once
+    bool entered;      // Preprocessed at least once
+    bool builtin;      // Compiled into the binary, not a file
+    const void *image; // Precompiled image of a built-in header, or NULL
+    size_t image_len;
+    int file_id;       // Source file of its tokens, -1 until first read
+    uint64_t dev, ino; // File identity
+} IncludeFile;
+
+// Standard header compiled into the binary (builtin_headers.c, generated
+// by embed_headers.c), with its precompiled image (header_image.c)
+typedef struct
+{
+    const char *name;
+    const char *text;
+    size_t len;
+    const unsigned char *image; // NULL in builtin_text.c
+    size_t image_len;
+} BuiltinHeader;
+
+extern const BuiltinHeader builtin_headers[];
+
+IncludeFile *include_open(const char *path);
+void include_add_dir(const char *dir, bool system);
+IncludeFile *include_find(const char *name, bool angled, const char *includer);
+bool include_write_deps(const char *path, const char *target, const char *source);
+
+// Typedef table (parse.c)
+typedef struct TypedefEntry TypedefEntry;
+struct TypedefEntry
+{
+    TypedefEntry *next;
+    const char *name; // Interned
+    Type *type;
+    Token *decl;     // First token of the declaration, if parsed
+    Token *decl_end; // Token after its ';'
+};
+
+extern TypedefEntry *typedef_table;
+void add_typedef(const char *name, Type *type);
+
+// Precompiled headers (pch.c)
+bool pch_write(const char *path, Token *tokens);
+bool pch_load(const char *path);
+Token *pch_prepend(Token *tokens);
+void pch_watch_macros(void);
+Token *pch_include(IncludeFile *inc, int *count);
+
 // Variable
 typedef struct Var Var;
 struct Var
 {
-    char *name; // Variable name
-    int len;    // Name length
-    int offset; // Offset from RBP
-    Type *type; // Type
+    const char *name; // Variable name
+    int len;          // Name length
+    int offset;       // Offset from RBP
+    Type *type;       // Type
 };
 
 // Local variable
 typedef struct LVar LVar;
 struct LVar
 {
-    LVar *next; // Next variable
-    char *name; // Variable name
-    int len;    // Name length
-    int offset; // Offset from RBP
-    Type *type; // Type
+    LVar *next;       // Next variable
+    const char *name; // Variable name (interned)
+    int len;          // Name length
+    int offset;       // Offset from RBP
+    Type *type;       // Type
 };
 
 // Forward declaration for Node
@@ -68,13 +251,15 @@ typedef struct Function Function;
 struct Function
 {
     Function *next;    // Next function
-    char *name;        // Function name
+    const char *name;  // Function name (interned)
     int len;           // Name length
     LVar *params;      // Parameters
     LVar *locals;      // Local variables
     Node *body;        // Function body
     int stack_size;    // Stack size required for local variables
     Type *return_type; // Function return type
+    bool is_variadic;  // Takes further arguments after "..."
+    bool is_prototype; // Declared without a body
 };
 
 // AST node types
@@ -130,46 +315,69 @@ typedef enum
     ND_LABEL             // Labeled statement
 } NodeKind;
 
-// AST node type
+// AST node. Every node starts with kind, next and type; the rest is a
+// union of per-kind layouts, and new_node() allocates only as much of it as
+// the kind uses. Reading a field of another layout is an error.
 struct Node
 {
-    NodeKind kind;         // Node kind
-    Node *next;            // Next node
-    Node *lhs;             // Left-hand side
-    Node *rhs;             // Right-hand side
-    Node *cond;            // Used by if, while, for, cond
-    Node *then;            // Used by if, while, for
-    Node *els;             // Used by if
-    Node *init;            // Used by for
-    Node *inc;             // Used by for
-    Node *body;            // Used by block, function definition
-    Node *default_case;    // Default case for switch
-    Node *break_target;    // Target for break
-    Node *continue_target; // Target for continue
-
-    // Function call
-    char *func_name;   // Function name
-    int func_name_len; // Function name length
-    Node *args;        // Arguments
-
-    // Function definition
-    LVar *params;   // Parameters
-    LVar *locals;   // Local variables
-    int stack_size; // Stack size required for local variables
-
-    // Array subscript
-    Node *index; // Array index expression
-
-    // Structure member access
-    Member *member; // Structure member
-
-    int val;    // Used if kind == ND_NUM
-    int offset; // Used if kind == ND_LVAR
-    Type *type; // Type
+    NodeKind kind; // Node kind
+    Node *next;    // Next node
+    Type *type;    // Type
+
+    union
+    {
+        // Operators, return, expression statements, member access,
+        // subscripts, calls and labels
+        struct
+        {
+            Node *lhs; // Left-hand side
+            Node *rhs; // Right-hand side
+            union
+            {
+                Member *member; // ND_MEMBER
+                Node *index;    // ND_ARRAY_SUBSCRIPT
+                // ND_FUNC_CALL, ND_FUNC_PTR_CALL and ND_LABEL
+                struct
+                {
+                    Node *args;            // Arguments
+                    const char *func_name; // Function or label name (interned)
+                    int func_name_len;     // Function name length
+                };
+            };
+        };
+
+        // if, while, for and ?:
+        struct
+        {
+            Node *cond; // Used by if, while, for, cond
+            Node *then; // Used by if, while, for
+            Node *els;  // Used by if
+            Node *init; // Used by for
+            Node *inc;  // Used by for
+        };
+
+        Node *body; // Used by block and initializer lists
+        int val;    // Used if kind == ND_NUM
+        int offset; // Used if kind == ND_LVAR
+    };
 };
 
 // Function prototypes
-Token *tokenize(char *p);
+typedef void TokenProducer(Token *tok);
+Token *token_stream(TokenProducer *produce, bool eager);
+bool lex_pp_token(char **p, int file_id, Token *tok);
+typedef struct LexAhead LexAhead;
+LexAhead *lex_ahead(char *text, size_t len, int file_id);
+bool lex_ahead_token(LexAhead *a, char **p, Token *tok);
+void lex_ahead_free(LexAhead *a);
+KeywordKind keyword_id(const char *p, int len);
+Token *next_token(Token *tok);
+void free_tokens(void);
+int source_file_add(const char *name, const char *text);
+const char *source_file_name(int file_id);
+const char *source_file_text(int file_id);
+void source_file_set_text(int file_id, const char *text);
+void token_position(Token *tok, int *line, int *column);
 void parse_program();
 
 // Tokenizer
@@ -190,8 +398,9 @@ void unget_token();
 // Parser
 Node *new_node(NodeKind kind, Node *lhs, Node *rhs);
 Node *new_node_num(int val);
+void free_nodes(void);
 Function *program();
-Function *function();
+Function *function(Type *return_type);
 Node *stmt(Function *fn);
 Node *expr(Function *fn);
 Node *assign(Function *fn);
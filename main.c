@@ -11,8 +11,7 @@ int error_count = 0;
 // Reports an error and continue
 void error(char *fmt, ...)
 {
-    fprintf(stderr, "[DEBUG] error() called\n");
-    fflush(stderr);
+    TRACE(TRACE_DRIVER, 2, "error() called");
     va_list ap;
     va_start(ap, fmt);
     vfprintf(stderr, fmt, ap);
@@ -29,7 +28,9 @@ void error_at(Token *tok, char *fmt, ...)
     }
     else
     {
-        fprintf(stderr, "%s:%d:%d: error: ", tok->file ? tok->file : "<input>", tok->line, tok->column);
+        int line, column;
+        token_position(tok, &line, &column);
+        fprintf(stderr, "%s:%d:%d: error: ", source_file_name(tok->file_id), line, column);
     }
     va_list ap;
     va_start(ap, fmt);
@@ -39,61 +40,6 @@ void error_at(Token *tok, char *fmt, ...)
     error_count++;
 }
 
-// Read input from stdin
-char *read_from_stdin()
-{
-    char *buffer = NULL;
-    size_t buffer_size = 0;
-    size_t content_size = 0;
-    size_t read_size;
-    const size_t chunk_size = 1024;
-
-    // Allocate initial buffer
-    buffer = malloc(chunk_size);
-    if (!buffer)
-    {
-        error("Memory allocation failed");
-        return NULL;
-    }
-    buffer_size = chunk_size;
-
-    // Read from stdin in chunks
-    while ((read_size = fread(buffer + content_size, 1, chunk_size, stdin)) > 0)
-    {
-        content_size += read_size;
-
-        // Check if we need more space
-        if (content_size + chunk_size > buffer_size)
-        {
-            buffer_size *= 2;
-            buffer = realloc(buffer, buffer_size);
-            if (!buffer)
-            {
-                error("Memory reallocation failed");
-                return NULL;
-            }
-        }
-    }
-
-    // Null-terminate the string
-    if (content_size < buffer_size)
-    {
-        buffer[content_size] = '\0';
-    }
-    else
-    {
-        buffer = realloc(buffer, buffer_size + 1);
-        if (!buffer)
-        {
-            error("Memory reallocation failed");
-            return NULL;
-        }
-        buffer[content_size] = '\0';
-    }
-
-    return buffer;
-}
-
 // Remove all preprocessor lines (lines starting with # after optional whitespace)
 char *strip_preprocessor_lines(const char *input)
 {
@@ -137,159 +83,173 @@ char *strip_preprocessor_lines(const char *input)
     return out;
 }
 
-int main(int argc, char **argv)
+// Returns the last path component of path with its extension replaced by ext
+static char *replace_extension(const char *path, const char *ext)
 {
-    // Debug: print argc and argv values
-    fprintf(stderr, "[DEBUG] argc = %d\n", argc);
-    for (int i = 0; i < argc; i++)
-    {
-        fprintf(stderr, "[DEBUG] argv[%d] = '%s'\n", i, argv[i]);
-    }
-
-    // Handle input from either command line argument or stdin
-    if (argc > 3)
-    {
-        error("Usage: %s [program] [-d]", argv[0]);
-        return 1;
-    }
+    const char *base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    const char *dot = strrchr(base, '.');
+    size_t len = dot ? (size_t)(dot - base) : strlen(base);
+    char *name = malloc(len + strlen(ext) + 1);
+    memcpy(name, base, len);
+    strcpy(name + len, ext);
+    return name;
+}
 
-    // Check for debug flag
-    bool debug_mode = false;
+int main(int argc, char **argv)
+{
+    // -d turns on phase-level tracing everywhere, --trace=SPEC picks
+    // categories and levels (see trace.c). --pch FILE writes a precompiled
+    // header for the input instead of compiling it, and --include-pch FILE
+    // starts from one (see pch.c). -MD also writes a make rule listing the
+    // files the input includes, to the file -MF names or else to the input's
+    // name with .d for .c; -MF alone implies -MD. -I DIR and -isystem DIR
+    // add directories to search for included files (see include.c).
+    char *input_path = NULL;
+    char *pch_out = NULL;
+    char *pch_in = NULL;
+    bool deps = false;
+    char *deps_path = NULL;
     for (int i = 1; i < argc; i++)
     {
         if (strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--debug") == 0)
+            trace_enable("all");
+        else if (strncmp(argv[i], "--trace=", 8) == 0)
+            trace_enable(argv[i] + 8);
+        else if (strcmp(argv[i], "--pch") == 0 && i + 1 < argc && !pch_in)
+            pch_out = argv[++i];
+        else if (strcmp(argv[i], "--include-pch") == 0 && i + 1 < argc && !pch_out)
+            pch_in = argv[++i];
+        else if (strcmp(argv[i], "-MD") == 0)
+            deps = true;
+        else if (strcmp(argv[i], "-MF") == 0 && i + 1 < argc)
         {
-            debug_mode = true;
-            break;
+            deps = true;
+            deps_path = argv[++i];
         }
-    }
-
-    if (argc >= 2 && argv[1][0] != '-')
-    {
-        // Debug: print first 32 bytes of input file
-        FILE *f = fopen(argv[1], "rb");
-        if (f)
+        else if (strcmp(argv[i], "-I") == 0 && i + 1 < argc)
+            include_add_dir(argv[++i], false);
+        else if (strncmp(argv[i], "-I", 2) == 0 && argv[i][2])
+            include_add_dir(argv[i] + 2, false);
+        else if (strcmp(argv[i], "-isystem") == 0 && i + 1 < argc)
+            include_add_dir(argv[++i], true);
+        else if (argv[i][0] != '-' && !input_path)
+            input_path = argv[i];
+        else
         {
-            unsigned char buf[32];
-            size_t n = fread(buf, 1, 32, f);
-            printf("[DEBUG] First 32 bytes of input file:\n");
-            for (size_t i = 0; i < n; ++i)
-                printf("%02X ", buf[i]);
-            printf("\n[DEBUG] As chars: ");
-            for (size_t i = 0; i < n; ++i)
-                printf("%c", (buf[i] >= 32 && buf[i] < 127) ? buf[i] : '.');
-            printf("\n");
-            fclose(f);
-        }
-        // Read the file contents into user_input
-        FILE *src = fopen(argv[1], "rb");
-        if (!src)
-        {
-            error("Could not open input file: %s", argv[1]);
+            error("Usage: %s [program] [-d] [--trace=SPEC] [--pch FILE | --include-pch FILE] [-MD [-MF FILE]] "
+                  "[-I DIR] [-isystem DIR]",
+                  argv[0]);
             return 1;
         }
-        fseek(src, 0, SEEK_END);
-        long fsize = ftell(src);
-        fseek(src, 0, SEEK_SET);
-        user_input = malloc(fsize + 1);
-        if (!user_input)
+    }
+    if (deps && !deps_path && !input_path)
+    {
+        error("-MD needs -MF when reading from stdin");
+        return 1;
+    }
+    TRACE(TRACE_DRIVER, 1, "argc = %d", argc);
+    for (int i = 0; i < argc; i++)
+        TRACE(TRACE_DRIVER, 1, "argv[%d] = '%s'", i, argv[i]);
+
+    // Handle input from either command line argument or stdin
+    static SourceBuffer input;
+    if (input_path)
+    {
+        // Map the file; the text starts after any BOM
+        if (!source_open(&input, input_path))
         {
-            error("Memory allocation failed");
-            fclose(src);
+            error("Could not open input file: %s", input_path);
             return 1;
         }
-        fread(user_input, 1, fsize, src);
-        user_input[fsize] = 0;
-        fclose(src);
-        // Skip UTF-8 BOM if present
-        if ((unsigned char)user_input[0] == 0xEF &&
-            (unsigned char)user_input[1] == 0xBB &&
-            (unsigned char)user_input[2] == 0xBF)
-        {
-            memmove(user_input, user_input + 3, fsize - 2);
-            fsize -= 3;
-            user_input[fsize] = 0;
-        }
+        user_input = input.data;
         // Check for empty file
-        if (fsize == 0 || user_input[0] == 0)
+        if (input.len == 0)
         {
             error("Input file is empty");
             return 1;
         }
-        // Debug: print first 32 bytes of user_input
-        printf("[DEBUG] First 32 bytes of user_input:\n");
-        for (size_t i = 0; i < 32 && user_input[i]; ++i)
-            printf("%02X ", (unsigned char)user_input[i]);
-        printf("\n[DEBUG] As chars: ");
-        for (size_t i = 0; i < 32 && user_input[i]; ++i)
-            printf("%c", (user_input[i] >= 32 && user_input[i] < 127) ? user_input[i] : '.');
-        printf("\n");
-
-        if (debug_mode)
+        // Trace the first 32 bytes of user_input
+        if (TRACE_ON(TRACE_DRIVER, 2))
         {
-            fprintf(stderr, "Debug: Processing code from file: %s\n", argv[1]);
+            char hex[32 * 3 + 1] = "", chars[32 + 1] = "";
+            for (size_t i = 0; i < 32 && user_input[i]; ++i)
+            {
+                sprintf(hex + i * 3, "%02X ", (unsigned char)user_input[i]);
+                chars[i] = (user_input[i] >= 32 && user_input[i] < 127) ? user_input[i] : '.';
+                chars[i + 1] = 0;
+            }
+            trace_print(TRACE_DRIVER, "first 32 bytes of user_input: %s", hex);
+            trace_print(TRACE_DRIVER, "as chars: %s", chars);
         }
+        TRACE(TRACE_DRIVER, 1, "processing code from file: %s", input_path);
     }
     else
     {
         // Input from stdin
-        fprintf(stderr, "Reading from stdin...\n");
-        user_input = read_from_stdin();
-        if (!user_input)
+        TRACE(TRACE_DRIVER, 1, "reading from stdin");
+        if (!source_read_stream(&input, stdin))
         {
             error("Failed to read from stdin");
             return 1;
         }
-
-        if (debug_mode)
-        {
-            fprintf(stderr, "Debug: Read %lu bytes from stdin\n", strlen(user_input));
-        }
+        user_input = input.data;
+        TRACE(TRACE_DRIVER, 1, "read %lu bytes from stdin", (unsigned long)input.len);
     }
 
-    // Debug print to show user_input before tokenize
-    fprintf(stderr, "[DEBUG] user_input before tokenize: %.32s\n", user_input);
-    // Preprocess the raw input buffer
-    char *preprocessed_input = preprocess_input(argv[1], user_input);
-    fprintf(stderr, "[DEBUG] preprocessed_input (first 200 chars):\n%.200s\n", preprocessed_input);
-    // Tokenize and preprocess
-    fprintf(stderr, "[MAIN DEBUG] About to call tokenize()\n");
-    token = tokenize(preprocessed_input);
-    fprintf(stderr, "[MAIN DEBUG] tokenize() returned, token=%p\n", (void *)token);
-    free(preprocessed_input);
+    TRACE(TRACE_DRIVER, 2, "user_input before tokenize: %.32s", user_input);
+    // A precompiled header's macros and typedefs are in place before the
+    // input is preprocessed
+    if (pch_in && !pch_load(pch_in))
+        return 1;
+    // The preprocessor lexes the input and its includes and hands the
+    // parser tokens as it asks for them. A header being precompiled is
+    // preprocessed up front, as the image refers to its tokens after parsing.
+    token = preprocess_tokens(input_path ? input_path : "<stdin>", user_input, pch_out != NULL);
+    Token *first_token = token;
+    token = pch_prepend(token);
+    TRACE(TRACE_LEX, 1, "preprocess_tokens() returned, token=%p", (void *)token);
 
-    // Debug: print the first 30 tokens after preprocessing
-    Token *dbg = token;
-    int dbg_count = 0;
-    fprintf(stderr, "[PREPROCESS DEBUG] First tokens after preprocessing:\n");
-    while (dbg && dbg->kind != TK_EOF && dbg_count < 30)
+    // Trace the first 30 tokens after preprocessing
+    if (TRACE_ON(TRACE_LEX, 2))
     {
-        fprintf(stderr, "  kind=%d, str='%.*s'\n", dbg->kind, dbg->len, dbg->str);
-        dbg = dbg->next;
-        dbg_count++;
+        Token *t = token;
+        trace_print(TRACE_LEX, "first tokens after preprocessing:");
+        for (int i = 0; t && t->kind != TK_EOF && i < 30; i++, t = next_token(t))
+            trace_print(TRACE_LEX, "  %d: kind=%d, str='%.*s'", i, t->kind, t->len, t->str);
     }
 
-    // Debug: print the first few tokens for tracing
-    Token *t = token;
-    int count = 0;
-    fprintf(stderr, "[DEBUG] First tokens after tokenization:\n");
-    while (t && t->kind != TK_EOF && count < 20)
+    // Parse the program
+    parse_program();
+    // Every include has been read by the time the parser reaches the end
+    if (deps && error_count == 0)
     {
-        fprintf(stderr, "  %d: kind=%d, str='%.*s'\n", count, t->kind, t->len, t->str);
-        t = t->next;
-        count++;
+        char *path = deps_path ? deps_path : replace_extension(input_path, ".d");
+        char *target = replace_extension(input_path ? input_path : "-", ".o");
+        if (!include_write_deps(path, target, input_path))
+            error("Could not write dependency file: %s", path);
+        if (path != deps_path)
+            free(path);
+        free(target);
+    }
+    if (pch_out)
+    {
+        bool ok = error_count == 0 &&
+                  pch_write(pch_out, first_token);
+        free_tokens();
+        free_nodes();
+        source_close(&input);
+        return ok ? 0 : 1;
     }
 
-    // Parse the program
-    parse_program();
+    // The parser copies every name it keeps, so the token stream can go now
+    free_tokens();
 
     // After parse_program(), print all function names in function_list
     extern Function *function_list;
-    fprintf(stderr, "[DEBUG] Functions parsed:\n");
+    TRACE(TRACE_PARSE, 1, "functions parsed:");
     for (Function *fn = function_list; fn; fn = fn->next)
-    {
-        fprintf(stderr, "  - %s\n", fn->name);
-    }
+        TRACE(TRACE_PARSE, 1, "  - %s", fn->name);
 
     // After parse_program(), generate code for all functions
     extern Function *function_list;
@@ -297,12 +257,9 @@ int main(int argc, char **argv)
     {
         codegen(fn);
     }
+    free_nodes();
 
-    // Free memory if allocated from stdin
-    if (argc == 1 || (argc == 2 && debug_mode))
-    {
-        free(user_input);
-    }
+    source_close(&input);
 
     // If any errors were reported, exit with failure
     if (error_count > 0)
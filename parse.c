@@ -4,8 +4,7 @@
 // Forward declarations
 static Node *function_pointer_call(Function *fn, Node *func_ptr);
 static Type *function_pointer_type();
-static Type *parse_declarator(Type *base_type, char **out_name, int *out_len);
-static void add_typedef(const char *name, Type *type);
+static Type *parse_declarator(Type *base_type, const char **out_name, int *out_len);
 static Type *find_typedef(const char *name);
 static Type *union_decl();
 static Type *enum_decl();
@@ -21,20 +20,121 @@ static char *my_strndup(const char *s, size_t n)
     return memcpy(new, s, n);
 }
 
-// Find a local variable by name
-static LVar *find_lvar(LVar *locals, Token *tok)
+// Local scopes: one table maps each interned name to the
+// innermost variable it names. Declaring a variable logs the binding it
+// hides, and popping a scope replays the log back to the scope's start, so
+// lookups never depend on the number of variables or scopes.
+typedef struct
 {
-    for (LVar *var = locals; var; var = var->next)
-        if (var->len == tok->len && !memcmp(tok->str, var->name, var->len))
-            return var;
-    return NULL;
+    const char *name; // Interned; stays once used, with var NULL when unbound
+    LVar *var;
+} ScopeSlot;
+
+typedef struct
+{
+    const char *name;
+    LVar *hidden; // Binding to restore when the scope ends
+} ScopeUndo;
+
+static PtrTable scopes = PTR_TABLE(ScopeSlot);
+static ScopeUndo *scope_log;
+static int scope_log_len;
+static int scope_log_cap;
+static int *scope_marks; // scope_log_len when each open scope began
+static int scope_depth;
+static int scope_marks_cap;
+
+// Opens a scope, such as a function's parameters or a block
+static void scope_push(void)
+{
+    if (scope_depth == scope_marks_cap)
+    {
+        scope_marks_cap = scope_marks_cap ? scope_marks_cap * 2 : 16;
+        scope_marks = realloc(scope_marks, sizeof(int) * scope_marks_cap);
+    }
+    scope_marks[scope_depth++] = scope_log_len;
+}
+
+// Closes the innermost scope, unhiding what its variables shadowed
+static void scope_pop(void)
+{
+    int mark = scope_marks[--scope_depth];
+    while (scope_log_len > mark)
+    {
+        ScopeUndo *u = &scope_log[--scope_log_len];
+        ((ScopeSlot *)ptr_table_find(&scopes, u->name))->var = u->hidden;
+    }
+}
+
+// Binds var's name to var in the innermost scope
+static void declare_lvar(LVar *var)
+{
+    ScopeSlot *slot = ptr_table_put(&scopes, var->name, NULL);
+    if (scope_log_len == scope_log_cap)
+    {
+        scope_log_cap = scope_log_cap ? scope_log_cap * 2 : 64;
+        scope_log = realloc(scope_log, sizeof(ScopeUndo) * scope_log_cap);
+    }
+    scope_log[scope_log_len++] = (ScopeUndo){var->name, slot->var};
+    slot->var = var;
+}
+
+// Find a local variable or parameter by name, innermost scope first
+static LVar *find_lvar(Token *tok)
+{
+    ScopeSlot *slot = ptr_table_find(&scopes, tok->name);
+    return slot ? slot->var : NULL;
+}
+
+// Every AST node of the compilation, released together by free_nodes()
+static Arena node_arena;
+
+// Returns the bytes of a Node that a node of this kind uses
+static size_t node_size(NodeKind kind)
+{
+    switch (kind)
+    {
+    case ND_NUM:
+        return offsetof(Node, val) + sizeof(int);
+    case ND_LVAR:
+        return offsetof(Node, offset) + sizeof(int);
+    case ND_IF:
+    case ND_WHILE:
+    case ND_FOR:
+        return offsetof(Node, inc) + sizeof(Node *);
+    case ND_MEMBER:
+        return offsetof(Node, member) + sizeof(Member *);
+    case ND_ARRAY_SUBSCRIPT:
+        return offsetof(Node, index) + sizeof(Node *);
+    case ND_FUNC_CALL:
+    case ND_FUNC_PTR_CALL:
+    case ND_LABEL:
+        return sizeof(Node);
+    default:
+        // Operators, and blocks: the code generator evaluates lhs and rhs
+        // of any kind it has no case for
+        return offsetof(Node, rhs) + sizeof(Node *);
+    }
+}
+
+// Allocates a zeroed node of the given kind
+static Node *alloc_node(NodeKind kind)
+{
+    Node *node = arena_alloc(&node_arena, node_size(kind));
+    node->kind = kind;
+    return node;
+}
+
+// Releases every AST node in one go
+void free_nodes(void)
+{
+    arena_release(&node_arena);
 }
 
 // Create a new AST node
 Node *new_node(NodeKind kind, Node *lhs, Node *rhs)
 {
-    Node *node = calloc(1, sizeof(Node));
-    node->kind = kind;
+    Node *node = alloc_node(kind);
     node->lhs = lhs;
     node->rhs = rhs;
     return node;
@@ -43,8 +143,7 @@ Node *new_node(NodeKind kind, Node *lhs, Node *rhs)
 // Create a new node for a number
 Node *new_node_num(int val)
 {
-    Node *node = calloc(1, sizeof(Node));
-    node->kind = ND_NUM;
+    Node *node = alloc_node(ND_NUM);
     node->val = val;
     return node;
 }
@@ -52,8 +151,7 @@ Node *new_node_num(int val)
 // Create a new node for a local variable
 static Node *new_node_lvar(LVar *lvar)
 {
-    Node *node = calloc(1, sizeof(Node));
-    node->kind = ND_LVAR;
+    Node *node = alloc_node(ND_LVAR);
     node->offset = lvar->offset;
     node->type = lvar->type;
     return node;
@@ -75,89 +173,69 @@ __attribute__((weak)) int size_of(Type *ty)
     return 0; // Unknown type
 }
 
-// Create a type for char
-__attribute__((weak)) Type *char_type(bool is_unsigned)
-{
-    Type *ty = calloc(1, sizeof(Type));
-    ty->kind = TY_CHAR;
-    ty->size = 1;
-    ty->qualifiers.is_unsigned = is_unsigned;
-    return ty;
-}
-
-// Create a new type for an array
-__attribute__((weak)) Type *array_of(Type *base, int size)
-{
-    Type *ty = calloc(1, sizeof(Type));
-    ty->kind = TY_ARRAY;
-    ty->ptr_to = base;
-    ty->size = base->size * size;
-    ty->array_size = size;
-    return ty;
-}
-
-// Create a new type for a pointer
-__attribute__((weak)) Type *pointer_to(Type *base)
-{
-    Type *ty = calloc(1, sizeof(Type));
-    ty->kind = TY_PTR;
-    ty->ptr_to = base;
-    ty->size = 8;
-    return ty;
-}
-
-// Global variable table
+// Global variable
 typedef struct GlobalVar
 {
-    struct GlobalVar *next;
-    char *name;
+    const char *name;
     Type *type;
     int has_initializer;
     int int_value; // Only support int initializers for now
 } GlobalVar;
-static GlobalVar *global_vars = NULL;
 
 // Global function list
 Function *function_list = NULL;
 static Function *function_list_tail = NULL;
 
-// Global function table for signature lookup
-typedef struct FunctionEntry
+// Global symbol table: functions, typedefs, global variables and tags, in
+// one open-addressing table keyed by interned name. A later definition of a
+// name replaces the earlier one of its kind.
+typedef struct
+{
+    const char *name;
+    Function *fn;       // Function definition or prototype, for signature lookup
+    Type *typedef_type; // Type the name is a typedef for
+    GlobalVar *var;     // Global variable
+    Type *tag_type;     // Struct, union or enum with this tag
+} GlobalSymbol;
+
+static PtrTable globals = PTR_TABLE(GlobalSymbol);
+
+// Returns the symbol for an interned name, adding it if needed
+static GlobalSymbol *global_symbol(const char *name)
+{
+    return ptr_table_put(&globals, name, NULL);
+}
+
+// Returns the symbol for an interned name, or NULL if nothing is declared
+// with it
+static GlobalSymbol *global_lookup(const char *name)
 {
-    struct FunctionEntry *next;
-    char *name;
-    Function *fn;
-} FunctionEntry;
-static FunctionEntry *function_table = NULL;
+    return ptr_table_find(&globals, name);
+}
 
 static void add_function_to_table(Function *fn)
 {
-    FunctionEntry *entry = calloc(1, sizeof(FunctionEntry));
-    entry->name = fn->name;
-    entry->fn = fn;
-    entry->next = function_table;
-    function_table = entry;
+    global_symbol(fn->name)->fn = fn;
 }
 
+// Names are interned, so entries are matched by pointer
 static Function *find_function_in_table(const char *name)
 {
-    for (FunctionEntry *entry = function_table; entry; entry = entry->next)
-    {
-        if (strcmp(entry->name, name) == 0)
-            return entry->fn;
-    }
-    return NULL;
+    GlobalSymbol *sym = global_lookup(name);
+    return sym ? sym->fn : NULL;
 }
 
 // Parse a global variable declaration
 static void parse_global_var(Type *type)
 {
-    Token *var_name = consume_ident();
+    const char *var_name;
+    int var_len;
+    Type *var_type = parse_declarator(type, &var_name, &var_len);
     if (!var_name)
         error_at(token, "expected global variable name, got '%.*s'", token->len, token->str);
     GlobalVar *gvar = calloc(1, sizeof(GlobalVar));
-    gvar->name = my_strndup(var_name->str, var_name->len);
-    gvar->type = type;
+    gvar->name = var_name;
+    gvar->type = var_type;
     if (consume("="))
     {
         // Only support integer initializers for now
@@ -165,7 +243,7 @@ static void parse_global_var(Type *type)
         {
             gvar->has_initializer = 1;
             gvar->int_value = token->val;
-            token = token->next;
+            token = next_token(token);
         }
         else
         {
@@ -173,14 +251,14 @@ static void parse_global_var(Type *type)
         }
     }
     expect(";");
-    gvar->next = global_vars;
-    global_vars = gvar;
+    if (var_name)
+        global_symbol(var_name)->var = gvar;
 }
 
-// Top-level parser loop: program = (global_decl | function_def)*
+// Top-level parser loop: program = (typedef | global_decl | function_def | prototype)*
 void parse_program()
 {
-    fprintf(stderr, "[DEBUG] Entering parse_program, token kind: %d, str: '%s'\n", token->kind, token->str ? token->str : "(null)");
+    TRACE(TRACE_PARSE, 1, "entering parse_program, token kind: %d, str: '%.*s'", token->kind, token->len, token->str);
     if (at_eof() || token->kind == TK_EOF)
         return;
     while (1)
@@ -188,86 +266,81 @@ void parse_program()
         if (at_eof() || token->kind == TK_EOF)
             break;
         // Typedef
+        Token *decl = token;
         if (consume_keyword("typedef"))
         {
             Type *aliased = type_specifier();
-            Token *td_name = consume_ident();
-            add_typedef(my_strndup(td_name->str, td_name->len), aliased);
-            expect(";");
-            if (at_eof() || token->kind == TK_EOF)
+            if (!aliased)
+            {
+                error_at(token, "expected a type, got '%.*s'", token->len, token->str);
                 break;
-            continue;
-        }
-        // Struct/union/enum tag declaration (skip for now)
-        if (consume_keyword("struct") || consume_keyword("union") || consume_keyword("enum"))
-        {
-            // Parse and discard the type
-            type_specifier();
-            // If it's a tag-only declaration, expect ';'
-            if (consume(";"))
+            }
+            const char *td_name;
+            int td_len;
+            Type *td_type = parse_declarator(aliased, &td_name, &td_len);
+            if (!td_name)
             {
-                if (at_eof() || token->kind == TK_EOF)
-                    break;
-                continue;
+                error_at(token, "expected typedef name, got '%.*s'", token->len, token->str);
+                break;
             }
-            // Otherwise, it's a definition, so keep going
+            add_typedef(td_name, td_type);
+            expect(";");
+            // Remember the declaration's tokens for --pch
+            typedef_table->decl = decl;
+            typedef_table->decl_end = token;
+            continue;
         }
-        // Try to parse a type specifier
         Type *type = type_specifier();
         if (!type)
+        {
+            error_at(token, "expected a declaration, got '%.*s'", token->len, token->str);
             break;
+        }
         if (at_eof() || token->kind == TK_EOF)
             break;
-        // Look ahead: if next token is an identifier and next-next is '(', it's a function definition
-        if (token->kind == TK_IDENT)
+        // A struct, union or enum declared on its own
+        if (consume(";"))
+            continue;
+        // Look ahead: a name followed by '(' is a function, and any stars
+        // before the name belong to its return type
+        Token *save = token;
+        while (consume("*"))
+            ;
+        bool is_function = consume_ident() && consume("(");
+        token = save; // Rewind
+        if (is_function)
         {
-            Token *save = token;
-            token = token->next;
-            if (consume("("))
-            {
-                // It's a function definition
-                token = save; // Rewind
-                Function *fn = function();
-                if (!function_list)
-                {
-                    function_list = fn;
-                    function_list_tail = fn;
-                }
-                else
-                {
-                    function_list_tail->next = fn;
-                    function_list_tail = fn;
-                }
-                add_function_to_table(fn);
-                if (at_eof() || token->kind == TK_EOF)
-                    break;
+            Function *fn = function(type);
+            add_function_to_table(fn);
+            // A prototype only declares the signature
+            if (fn->is_prototype)
                 continue;
+            if (!function_list)
+            {
+                function_list = fn;
+                function_list_tail = fn;
             }
             else
             {
-                token = save; // Rewind
+                function_list_tail->next = fn;
+                function_list_tail = fn;
             }
+            continue;
         }
         // Otherwise, it's a global variable declaration
         parse_global_var(type);
-        if (at_eof() || token->kind == TK_EOF)
-            break;
     }
-    fprintf(stderr, "[DEBUG] Exiting parse_program, token kind: %d, str: '%s'\n", token->kind, token->str ? token->str : "(null)");
-    if (at_eof() || token->kind == TK_EOF)
-        return;
+    TRACE(TRACE_PARSE, 1, "exiting parse_program, token kind: %d, str: '%.*s'", token->kind, token->len, token->str);
 }
 
 // Create a new local variable
-static LVar *new_lvar(char *name, int len)
+static LVar *new_lvar(const char *name, int len)
 {
     LVar *var = calloc(1, sizeof(LVar));
     var->name = name;
     var->len = len;
 
-    Type *type = calloc(1, sizeof(Type));
-    type->kind = TY_INT;
-    var->type = type;
+    var->type = int_type(false);
 
     return var;
 }
@@ -276,7 +349,7 @@ static LVar *new_lvar(char *name, int len)
 // int name[SIZE]?;
 static LVar *declare_variable(Token *ident, Type *base_type)
 {
-    LVar *var = new_lvar(my_strndup(ident->str, ident->len), ident->len);
+    LVar *var = new_lvar(ident->name, ident->len);
     var->type = base_type;
 
     // Check for array declaration
@@ -290,79 +363,91 @@ static LVar *declare_variable(Token *ident, Type *base_type)
     return var;
 }
 
-// function = "int" ident "(" params? ")" "{" stmt* "}"
-// params = param ("," param)*
-// param = "int" ident
-Function *function()
+// function = pointers ident "(" params? ")" ("{" stmt* "}" | ";")
+// params = "void" | param ("," param)* ("," "...")?
+// param = type_specifier declarator
+// The return type's specifiers have been parsed by the caller.
+Function *function(Type *return_type)
 {
-    fprintf(stderr, "Parsing function...\n");
-    // Parse return type
-    Type *return_type = type_specifier();
+    TRACE(TRACE_PARSE, 1, "parsing function");
+    while (consume("*"))
+        return_type = pointer_to(return_type);
 
     // Get function name
     Token *ident = consume_ident();
     if (!ident)
         error_at(token, "expected function name, got '%.*s'", token->len, token->str);
 
-    fprintf(stderr, "Function name: %.*s\n", ident->len, ident->str);
+    TRACE(TRACE_PARSE, 1, "function name: %.*s", ident->len, ident->str);
 
     // Create function node
     Function *fn = calloc(1, sizeof(Function));
-    fn->name = my_strndup(ident->str, ident->len);
+    fn->name = ident->name;
     fn->len = ident->len;
+    fn->return_type = return_type;
     fn->params = NULL;
     fn->locals = NULL;
 
-    // Parse parameters
+    // Parse parameters, in a scope of their own that the body's locals can
+    // shadow
+    scope_push();
     expect("(");
 
-    if (!consume(")"))
+    // "(void)" declares that there are no parameters
+    Token *params = token;
+    if (!consume(")") && !(consume_keyword("void") && consume(")")))
     {
-        // Parse the first parameter
-        Type *param_type = type_specifier();
-        Token *param_tok = consume_ident();
-        if (!param_tok)
-            error_at(token, "expected parameter name, got '%.*s'", token->len, token->str);
-
-        char *param_name;
-        int param_len;
-        Type *full_param_type = parse_declarator(param_type, &param_name, &param_len);
-        LVar *param = new_lvar(param_name, param_len);
-        param->type = full_param_type;
-        param->offset = 8; // RBP + 8 (return address)
-        fn->params = param;
-
-        LVar *cur = param;
-
-        // Parse remaining parameters
-        while (consume(","))
+        token = params;
+        LVar head = {};
+        LVar *cur = &head;
+        do
         {
-            param_type = type_specifier();
-            param_tok = consume_ident();
-            if (!param_tok)
-                error_at(token, "expected parameter name, got '%.*s'", token->len, token->str);
+            if (consume("..."))
+            {
+                fn->is_variadic = true;
+                break;
+            }
+            Type *param_type = type_specifier();
+            if (!param_type)
+            {
+                error_at(token, "expected parameter type, got '%.*s'", token->len, token->str);
+                param_type = int_type(false);
+            }
 
-            char *param_name;
+            // Prototypes may leave parameters unnamed
+            const char *param_name;
             int param_len;
             Type *full_param_type = parse_declarator(param_type, &param_name, &param_len);
-            param = new_lvar(param_name, param_len);
+            LVar *param = new_lvar(param_name, param_len);
             param->type = full_param_type;
-            param->offset = cur->offset + 8;
+            param->offset = cur == &head ? 8 : cur->offset + 8; // RBP + 8 (return address)
             cur->next = param;
             cur = param;
-        }
+            if (param_name)
+                declare_lvar(param);
+        } while (consume(","));
+        fn->params = head.next;
 
         expect(")");
     }
 
+    // A prototype ends at its parameter list
+    if (consume(";"))
+    {
+        scope_pop();
+        fn->is_prototype = true;
+        return fn;
+    }
+
     // Parse function body
     expect("{");
+    scope_push();
 
     Node head;
     head.next = NULL;
     Node *cur = &head;
 
-    fprintf(stderr, "Parsing function body...\n");
+    TRACE(TRACE_PARSE, 1, "parsing function body");
 
     while (!consume("}"))
     {
@@ -370,8 +455,8 @@ Function *function()
         Type *decl_type = type_specifier();
         if (decl_type)
         {
-            fprintf(stderr, "Found variable declaration\n");
-            char *var_name;
+            TRACE(TRACE_PARSE, 2, "found variable declaration");
+            const char *var_name;
             int var_len;
             Type *full_type = parse_declarator(decl_type, &var_name, &var_len);
             Token *var_name_tok = consume_ident();
@@ -410,6 +495,7 @@ Function *function()
 
             lvar->next = fn->locals;
             fn->locals = lvar;
+            declare_lvar(lvar);
 
             // Check for initializer
             Node *init_node = NULL;
@@ -426,11 +512,10 @@ Function *function()
                         cur_init = cur_init->next;
                     } while (consume(","));
                     expect("}");
-                    init_node = calloc(1, sizeof(Node));
-                    init_node->kind = ND_INIT_LIST;
+                    init_node = alloc_node(ND_INIT_LIST);
                     init_node->body = head.next;
                 }
-                else if (token->kind == TK_IDENT && token->next && strcmp(token->next->str, "{") == 0)
+                else if (token->kind == TK_IDENT && next_token(token) && strcmp(next_token(token)->str, "{") == 0)
                 {
                     // Compound literal: (struct S){...}
                     Type *cl_type = type_specifier();
@@ -443,15 +528,13 @@ Function *function()
                         cur_init = cur_init->next;
                     } while (consume(","));
                     expect("}");
-                    init_node = calloc(1, sizeof(Node));
-                    init_node->kind = ND_COMPOUND_LITERAL;
+                    init_node = alloc_node(ND_COMPOUND_LITERAL);
                     init_node->type = cl_type;
                     init_node->body = head.next;
                 }
                 else
                 {
-                    Node *lhs = calloc(1, sizeof(Node));
-                    lhs->kind = ND_LVAR;
+                    Node *lhs = alloc_node(ND_LVAR);
                     lhs->offset = lvar->offset;
                     lhs->type = lvar->type;
                     Node *rhs = expr(fn);
@@ -463,8 +546,7 @@ Function *function()
 
             if (init_node)
             {
-                cur->next = calloc(1, sizeof(Node));
-                cur->next->kind = ND_EXPR_STMT;
+                cur->next = alloc_node(ND_EXPR_STMT);
                 cur->next->lhs = init_node;
                 cur = cur->next;
             }
@@ -476,7 +558,9 @@ Function *function()
         cur = cur->next;
     }
 
-    fprintf(stderr, "Function body parsing complete\n");
+    scope_pop();
+    scope_pop();
+    TRACE(TRACE_PARSE, 1, "function body parsing complete");
 
     fn->body = head.next;
 
@@ -490,7 +574,7 @@ Function *function()
     }
     fn->stack_size = stack_size;
 
-    fprintf(stderr, "Function parsed successfully, stack size: %d\n", stack_size);
+    TRACE(TRACE_PARSE, 1, "function parsed successfully, stack size: %d", stack_size);
 
     return fn;
 }
@@ -510,29 +594,26 @@ Node *stmt(Function *fn)
     // Empty statement
     if (consume(";"))
     {
-        node = calloc(1, sizeof(Node));
-        node->kind = ND_BLOCK; // Use block as a no-op
+        node = alloc_node(ND_BLOCK); // Use block as a no-op
         node->body = NULL;
         return node;
     }
 
     // Labeled statement
-    if (token->kind == TK_IDENT && token->next && strcmp(token->next->str, ":") == 0)
+    if (token->kind == TK_IDENT && next_token(token) && strcmp(next_token(token)->str, ":") == 0)
     {
         Token *label_tok = token;
-        token = token->next->next; // skip ident and ':'
-        node = calloc(1, sizeof(Node));
-        node->kind = ND_LABEL;
-        node->func_name = my_strndup(label_tok->str, label_tok->len); // reuse func_name for label name
+        token = next_token(next_token(token)); // skip ident and ':'
+        node = alloc_node(ND_LABEL);
+        node->func_name = label_tok->name; // reuse func_name for label name
         node->lhs = stmt(fn);
         return node;
     }
 
     if (consume_keyword("return"))
     {
-        fprintf(stderr, "Parsing return statement\n");
-        node = calloc(1, sizeof(Node));
-        node->kind = ND_RETURN;
+        TRACE(TRACE_PARSE, 2, "parsing return statement");
+        node = alloc_node(ND_RETURN);
         node->lhs = expr(fn);
         expect(";");
         if (fn && node->kind == ND_RETURN && node->lhs && node->lhs->type && fn->return_type)
@@ -547,9 +628,8 @@ Node *stmt(Function *fn)
 
     if (consume_keyword("if"))
     {
-        fprintf(stderr, "Parsing if statement\n");
-        node = calloc(1, sizeof(Node));
-        node->kind = ND_IF;
+        TRACE(TRACE_PARSE, 2, "parsing if statement");
+        node = alloc_node(ND_IF);
         expect("(");
         node->cond = expr(fn);
         expect(")");
@@ -561,9 +641,8 @@ Node *stmt(Function *fn)
 
     if (consume_keyword("while"))
     {
-        fprintf(stderr, "Parsing while statement\n");
-        node = calloc(1, sizeof(Node));
-        node->kind = ND_WHILE;
+        TRACE(TRACE_PARSE, 2, "parsing while statement");
+        node = alloc_node(ND_WHILE);
         expect("(");
         node->cond = expr(fn);
         expect(")");
@@ -573,9 +652,8 @@ Node *stmt(Function *fn)
 
     if (consume_keyword("for"))
     {
-        fprintf(stderr, "Parsing for statement\n");
-        node = calloc(1, sizeof(Node));
-        node->kind = ND_FOR;
+        TRACE(TRACE_PARSE, 2, "parsing for statement");
+        node = alloc_node(ND_FOR);
         expect("(");
 
         if (!consume(";"))
@@ -602,24 +680,25 @@ Node *stmt(Function *fn)
 
     if (consume("{"))
     {
-        fprintf(stderr, "Parsing block statement\n");
+        TRACE(TRACE_PARSE, 2, "parsing block statement");
         Node head;
         head.next = NULL;
         Node *cur = &head;
 
+        scope_push();
         while (!consume("}"))
         {
             cur->next = stmt(fn);
             cur = cur->next;
         }
+        scope_pop();
 
-        node = calloc(1, sizeof(Node));
-        node->kind = ND_BLOCK;
+        node = alloc_node(ND_BLOCK);
         node->body = head.next;
         return node;
     }
 
-    fprintf(stderr, "Parsing expression statement\n");
+    TRACE(TRACE_PARSE, 2, "parsing expression statement");
     node = expr(fn);
     expect(";");
     return node;
@@ -641,8 +720,7 @@ Node *conditional(Function *fn)
 
     if (consume("?"))
     {
-        Node *cond_node = calloc(1, sizeof(Node));
-        cond_node->kind = ND_IF;
+        Node *cond_node = alloc_node(ND_IF);
         cond_node->cond = node;
         cond_node->then = expr(fn);
 
@@ -762,8 +840,7 @@ Node *add(Function *fn)
             {
                 if (!rhs->type || !is_integer_type(rhs->type))
                     error_at(token, "Can only add integer to pointer");
-                Node *scaled = calloc(1, sizeof(Node));
-                scaled->kind = ND_MUL;
+                Node *scaled = alloc_node(ND_MUL);
                 scaled->lhs = rhs;
                 scaled->rhs = new_node_num(size_of(node->type->ptr_to));
                 node = new_node(ND_ADD, node, scaled);
@@ -772,8 +849,7 @@ Node *add(Function *fn)
             {
                 if (!node->type || !is_integer_type(node->type))
                     error_at(token, "Can only add integer to pointer");
-                Node *scaled = calloc(1, sizeof(Node));
-                scaled->kind = ND_MUL;
+                Node *scaled = alloc_node(ND_MUL);
                 scaled->lhs = node;
                 scaled->rhs = new_node_num(size_of(rhs->type->ptr_to));
                 node = new_node(ND_ADD, rhs, scaled);
@@ -790,8 +866,7 @@ Node *add(Function *fn)
             // Handle pointer arithmetic: ptr - int
             if (node->type && node->type->kind == TY_PTR && rhs->type && is_integer_type(rhs->type))
             {
-                Node *scaled = calloc(1, sizeof(Node));
-                scaled->kind = ND_MUL;
+                Node *scaled = alloc_node(ND_MUL);
                 scaled->lhs = rhs;
                 scaled->rhs = new_node_num(size_of(node->type->ptr_to));
                 node = new_node(ND_SUB, node, scaled);
@@ -802,8 +877,7 @@ Node *add(Function *fn)
                 if (!is_compatible(node->type, rhs->type))
                     error_at(token, "Pointer subtraction requires both pointers to be of the same type");
                 Node *diff = new_node(ND_SUB, node, rhs);
-                Node *div = calloc(1, sizeof(Node));
-                div->kind = ND_DIV;
+                Node *div = alloc_node(ND_DIV);
                 div->lhs = diff;
                 div->rhs = new_node_num(size_of(node->type->ptr_to));
                 node = div;
@@ -845,8 +919,7 @@ Node *unary(Function *fn)
         return new_node(ND_SUB, new_node_num(0), primary(fn));
     if (consume("&"))
     {
-        Node *node = calloc(1, sizeof(Node));
-        node->kind = ND_ADDR;
+        Node *node = alloc_node(ND_ADDR);
         node->lhs = unary(fn);
         // The result type is a pointer to the operand's type
         if (node->lhs->type)
@@ -855,8 +928,7 @@ Node *unary(Function *fn)
     }
     if (consume("*"))
     {
-        Node *node = calloc(1, sizeof(Node));
-        node->kind = ND_DEREF;
+        Node *node = alloc_node(ND_DEREF);
         node->lhs = unary(fn);
         // The result type is the base type of the pointer
         if (node->lhs->type && node->lhs->type->kind == TY_PTR)
@@ -909,8 +981,7 @@ Node *primary(Function *fn)
             }
 
             // Otherwise, it's just a regular dereference
-            Node *node = calloc(1, sizeof(Node));
-            node->kind = ND_DEREF;
+            Node *node = alloc_node(ND_DEREF);
             node->lhs = ptr;
             return node;
         }
@@ -924,15 +995,14 @@ Node *primary(Function *fn)
     Token *tok = consume_ident();
     if (tok)
     {
-        fprintf(stderr, "Found identifier: %.*s\n", tok->len, tok->str);
+        TRACE(TRACE_PARSE, 2, "found identifier: %.*s", tok->len, tok->str);
 
         // Function call
         if (consume("("))
         {
-            fprintf(stderr, "Function call\n");
-            Node *node = calloc(1, sizeof(Node));
-            node->kind = ND_FUNC_CALL;
-            node->func_name = my_strndup(tok->str, tok->len);
+            TRACE(TRACE_PARSE, 2, "function call");
+            Node *node = alloc_node(ND_FUNC_CALL);
+            node->func_name = tok->name;
             node->func_name_len = tok->len;
             node->args = func_args(fn);
 
@@ -945,7 +1015,8 @@ Node *primary(Function *fn)
                 int param_index = 0;
                 while (param && arg)
                 {
-                    if (!is_compatible(param->type, arg->type))
+                    // Not every expression is typed yet; those go unchecked
+                    if (arg->type && !is_compatible(param->type, arg->type))
                     {
                         error_at(token, "Type mismatch in argument %d of function '%s'", param_index + 1, node->func_name);
                     }
@@ -953,7 +1024,7 @@ Node *primary(Function *fn)
                     arg = arg->next;
                     param_index++;
                 }
-                if (param || arg)
+                if (param || (arg && !decl->is_variadic))
                 {
                     error_at(token, "Argument count mismatch in call to function '%s'", node->func_name);
                 }
@@ -963,16 +1034,9 @@ Node *primary(Function *fn)
         }
 
         // Variable reference
-        LVar *lvar = find_lvar(fn->locals, tok);
+        LVar *lvar = find_lvar(tok);
         if (!lvar)
-        {
-            // Check if it's a parameter
-            lvar = find_lvar(fn->params, tok);
-            if (!lvar)
-            {
-                error_at(token, "Variable not declared: %.*s", tok->len, tok->str);
-            }
-        }
+            error_at(token, "Variable not declared: %.*s", tok->len, tok->str);
 
         Node *node = new_node_lvar(lvar);
 
@@ -990,24 +1054,13 @@ Node *primary(Function *fn)
                     error_at(token, "member access on non-struct type");
 
                 // Find the member in the structure
-                Member *member = NULL;
-                for (Member *mem = node->type->members; mem; mem = mem->next)
-                {
-                    int name_len = strlen(mem->name);
-                    if (name_len == member_name->len &&
-                        !memcmp(mem->name, member_name->str, name_len))
-                    {
-                        member = mem;
-                        break;
-                    }
-                }
+                Member *member = find_member(node->type, member_name->name);
 
                 if (!member)
                     error_at(token, "member '%.*s' not found in structure", member_name->len, member_name->str);
 
                 // Create member access node
-                Node *member_node = calloc(1, sizeof(Node));
-                member_node->kind = ND_MEMBER;
+                Node *member_node = alloc_node(ND_MEMBER);
                 member_node->lhs = node;
                 member_node->member = member;
                 member_node->type = member->ty;
@@ -1022,8 +1075,7 @@ Node *primary(Function *fn)
                 Node *index = expr(fn);
                 expect("]");
 
-                Node *array_node = calloc(1, sizeof(Node));
-                array_node->kind = ND_ARRAY_SUBSCRIPT;
+                Node *array_node = alloc_node(ND_ARRAY_SUBSCRIPT);
                 array_node->lhs = node;
                 array_node->index = index;
 
@@ -1045,28 +1097,56 @@ Node *primary(Function *fn)
     // String literal
     if (token->kind == TK_STR)
     {
-        Node *node = calloc(1, sizeof(Node));
-        node->kind = ND_NUM;                       // Use ND_NUM for now, or define ND_STR if desired
+        Node *node = alloc_node(ND_NUM); // Use ND_NUM for now, or define ND_STR if desired
         node->val = 0;                             // String literals are not evaluated to a value
         node->type = pointer_to(char_type(false)); // char *
-        token = token->next;
+        token = next_token(token);
         return node;
     }
 
     return new_node_num(expect_number());
 }
 
-// Create a structure type
+// Returns the type a struct, union or enum tag names, declaring an
+// incomplete one the first time the tag is seen
+static Type *tag_type(Token *tag, TypeKind kind)
+{
+    GlobalSymbol *sym = global_symbol(tag->name);
+    if (!sym->tag_type)
+    {
+        sym->tag_type = kind == TY_ENUM ? enum_type(tag->name) : calloc(1, sizeof(Type));
+        sym->tag_type->kind = kind;
+    }
+    else if (sym->tag_type->kind != kind)
+    {
+        error_at(tag, "'%.*s' is declared as a different kind of tag", tag->len, tag->str);
+    }
+    return sym->tag_type;
+}
+
+// Create a structure type, after the "struct" keyword. A tag with no member
+// list refers to the struct declared with it, or declares an incomplete one.
 static Type *struct_decl()
 {
-    fprintf(stderr, "[DEBUG] Entering struct_decl, token kind: %d, str: '%s'\n", token->kind, token->str ? token->str : "(null)");
+    TRACE(TRACE_PARSE, 2, "entering struct_decl, token kind: %d, str: '%.*s'", token->kind, token->len, token->str);
     if (at_eof() || token->kind == TK_EOF)
         return NULL;
-    expect("struct");
     Token *tag = consume_ident();
-    Type *ty = calloc(1, sizeof(Type));
-    ty->kind = TY_STRUCT;
-    expect("{");
+    if (tag && !consume("{"))
+        return tag_type(tag, TY_STRUCT);
+    Type *ty;
+    if (tag)
+    {
+        ty = tag_type(tag, TY_STRUCT);
+        if (ty->members)
+            error_at(tag, "redefinition of struct '%.*s'", tag->len, tag->str);
+    }
+    else
+    {
+        ty = calloc(1, sizeof(Type));
+        ty->kind = TY_STRUCT;
+        expect("{");
+    }
     Member head = {};
     Member *cur = &head;
     int offset = 0;
@@ -1074,141 +1154,166 @@ static Type *struct_decl()
     int storage_unit_size = 4 * 8; // 4 bytes = 32 bits
     while (!consume("}"))
     {
+        if (at_eof())
+        {
+            error_at(token, "expected '}', but got EOF");
+            break;
+        }
         Type *member_type = type_specifier();
-        char *member_name;
-        int member_len;
-        Type *full_member_type = parse_declarator(member_type, &member_name, &member_len);
-        Member *mem = calloc(1, sizeof(Member));
-        mem->name = my_strndup(member_name, member_len);
-        mem->ty = full_member_type;
-        mem->bit_width = 0;
-        mem->bit_offset = 0;
-        int is_flexible_array = 0;
-        if (consume(":"))
+        if (!member_type)
         {
-            mem->bit_width = expect_number();
-            if (bit_offset + mem->bit_width > storage_unit_size)
-            {
-                offset += 4;
-                bit_offset = 0;
-            }
-            mem->offset = offset;
-            mem->bit_offset = bit_offset;
-            bit_offset += mem->bit_width;
-            if (bit_offset == storage_unit_size)
-            {
-                offset += 4;
-                bit_offset = 0;
-            }
+            error_at(token, "expected member type, got '%.*s'", token->len, token->str);
+            member_type = int_type(false);
         }
-        else
+        // Members sharing a type may be declared together: "int quot, rem;"
+        do
         {
-            if (consume("["))
+            const char *member_name;
+            int member_len;
+            Type *full_member_type = parse_declarator(member_type, &member_name, &member_len);
+            Member *mem = calloc(1, sizeof(Member));
+            mem->name = member_name;
+            mem->ty = full_member_type;
+            mem->bit_width = 0;
+            mem->bit_offset = 0;
+            int is_flexible_array = 0;
+            if (consume(":"))
             {
-                // Check for flexible array member
-                if (token->kind == "]")
+                mem->bit_width = expect_number();
+                if (bit_offset + mem->bit_width > storage_unit_size)
                 {
-                    // Flexible array: []
-                    expect("]");
-                    mem->ty = array_of(full_member_type, 0);
-                    is_flexible_array = 1;
+                    offset += 4;
+                    bit_offset = 0;
                 }
-                else
+                mem->offset = offset;
+                mem->bit_offset = bit_offset;
+                bit_offset += mem->bit_width;
+                if (bit_offset == storage_unit_size)
                 {
-                    int size = expect_number();
-                    expect("]");
-                    mem->ty = array_of(full_member_type, size);
+                    offset += 4;
+                    bit_offset = 0;
                 }
             }
-            // Not a bitfield: align to next storage unit
-            if (bit_offset != 0)
+            else
             {
-                offset += 4;
-                bit_offset = 0;
+                if (consume("["))
+                {
+                    // Check for flexible array member
+                    if (token->kind == "]")
+                    {
+                        // Flexible array: []
+                        expect("]");
+                        mem->ty = array_of(full_member_type, 0);
+                        is_flexible_array = 1;
+                    }
+                    else
+                    {
+                        int size = expect_number();
+                        expect("]");
+                        mem->ty = array_of(full_member_type, size);
+                    }
+                }
+                // Not a bitfield: align to next storage unit
+                if (bit_offset != 0)
+                {
+                    offset += 4;
+                    bit_offset = 0;
+                }
+                mem->offset = offset;
+                mem->bit_offset = 0;
+                // Only add to struct size if not a flexible array
+                if (!is_flexible_array)
+                    offset += size_of(mem->ty);
             }
-            mem->offset = offset;
-            mem->bit_offset = 0;
-            // Only add to struct size if not a flexible array
-            if (!is_flexible_array)
-                offset += size_of(mem->ty);
-        }
-        cur->next = mem;
-        cur = mem;
+            cur->next = mem;
+            cur = mem;
+        } while (consume(","));
         expect(";");
     }
     if (bit_offset != 0)
         offset += 4;
     ty->members = head.next;
+    index_members(ty);
     ty->size = offset;
     return ty;
 }
 
-// Type specifier parser
+// Type specifier parser. Storage classes and qualifiers are accepted and
+// dropped, as nothing tracks them yet; the integer keywords combine in any
+// order, as in "unsigned long int".
 static Type *type_specifier()
 {
-    fprintf(stderr, "[DEBUG] Entering type_specifier, token kind: %d, str: '%s'\n", token->kind, token->str ? token->str : "(null)");
+    TRACE(TRACE_PARSE, 2, "entering type_specifier, token kind: %d, str: '%.*s'", token->kind, token->len, token->str);
     if (at_eof() || token->kind == TK_EOF)
         return NULL;
-    // Check for struct type
-    if (consume("struct"))
-    {
-        if (at_eof() || token->kind == TK_EOF)
-            return NULL;
-        unget_token(); // Put back 'struct' so struct_decl() can consume it
-        if (at_eof() || token->kind == TK_EOF)
-            return NULL;
+    while (consume_keyword("const") || consume_keyword("volatile") || consume_keyword("extern") ||
+           consume_keyword("static") || consume_keyword("register"))
+        ;
+    if (consume_keyword("struct"))
         return struct_decl();
-    }
-    if (consume("union"))
-    {
-        if (at_eof() || token->kind == TK_EOF)
-            return NULL;
-        unget_token();
-        if (at_eof() || token->kind == TK_EOF)
-            return NULL;
+    if (consume_keyword("union"))
         return union_decl();
-    }
-    if (consume("enum"))
-    {
-        if (at_eof() || token->kind == TK_EOF)
-            return NULL;
-        unget_token();
-        if (at_eof() || token->kind == TK_EOF)
-            return NULL;
+    if (consume_keyword("enum"))
         return enum_decl();
-    }
-    // Check for char type
-    if (consume_keyword("char"))
+    if (token->kind == TK_IDENT)
     {
-        return char_type(false);
+        Type *ty = find_typedef(token->name);
+        // The va_list of <stdarg.h>: arguments are walked with a plain pointer
+        if (!ty && strcmp(token->name, "__builtin_va_list") == 0)
+            ty = pointer_to(char_type(false));
+        if (ty)
+            token = next_token(token);
+        return ty;
     }
+    if (consume_keyword("void"))
+        return void_type();
     if (consume_keyword("float"))
-    {
         return float_type();
-    }
     if (consume_keyword("double"))
     {
         if (consume_keyword("long"))
             return longdouble_type();
         return double_type();
     }
-    if (consume_keyword("long"))
+    bool seen = false;
+    bool is_unsigned = false;
+    bool is_char = false;
+    bool is_short = false;
+    int longs = 0;
+    for (;;)
     {
-        if (consume_keyword("double"))
+        if (consume_keyword("unsigned"))
+            is_unsigned = true;
+        else if (consume_keyword("char"))
+            is_char = true;
+        else if (consume_keyword("short"))
+            is_short = true;
+        else if (consume_keyword("long"))
+            longs++;
+        else if (longs && consume_keyword("double"))
             return longdouble_type();
-        return long_type(false);
+        else if (!consume_keyword("signed") && !consume_keyword("int") &&
+                 !consume_keyword("const") && !consume_keyword("volatile"))
+            break;
+        seen = true;
     }
     // If not at a valid type keyword, return NULL instead of calling expect("int")
-    if (!consume_keyword("int"))
+    if (!seen)
         return NULL;
-    Type *ty = calloc(1, sizeof(Type));
-    ty->kind = TY_INT;
-    return ty;
+    if (is_char)
+        return char_type(is_unsigned);
+    if (is_short)
+        return short_type(is_unsigned);
+    if (longs > 1)
+        return longlong_type(is_unsigned);
+    if (longs)
+        return long_type(is_unsigned);
+    return int_type(is_unsigned);
 }
 
 // Unified declarator parser: parses pointer stars, arrays, function pointers, and identifier
 // Returns the final type and sets *out_name and *out_len to the variable name and length
-static Type *parse_declarator(Type *base_type, char **out_name, int *out_len)
+static Type *parse_declarator(Type *base_type, const char **out_name, int *out_len)
 {
     Type *ty = base_type;
     // Parse pointer stars
@@ -1232,9 +1337,9 @@ static Type *parse_declarator(Type *base_type, char **out_name, int *out_len)
         if (token->kind == TK_IDENT)
         {
             ident = token;
-            *out_name = my_strndup(ident->str, ident->len);
+            *out_name = ident->name;
             *out_len = ident->len;
-            token = token->next;
+            token = next_token(token);
         }
         else
         {
@@ -1256,33 +1361,23 @@ static Type *parse_declarator(Type *base_type, char **out_name, int *out_len)
         if (consume("("))
         {
             // Function type: parse parameter types (for now, treat as function returning ty)
-            // We'll need to build a function type node
-            Type *func_ty = calloc(1, sizeof(Type));
-            func_ty->kind = TY_FUNC;
-            func_ty->return_type = ty;
-            func_ty->params = NULL;
-            func_ty->param_count = 0;
-
-            // Parse parameter list
+            Type **params = NULL;
+            int param_count = 0;
             if (!consume(")"))
             {
-                // Parse first parameter
-                Type **params = NULL;
-                int param_count = 0;
                 do
                 {
                     Type *param_type = type_specifier();
-                    char *param_name = NULL;
+                    const char *param_name = NULL;
                     int param_len = 0;
                     parse_declarator(param_type, &param_name, &param_len); // ignore name
                     params = realloc(params, sizeof(Type *) * (param_count + 1));
                     params[param_count++] = param_type;
                 } while (consume(","));
                 expect(")");
-                func_ty->params = params;
-                func_ty->param_count = param_count;
             }
-            ty = func_ty;
+            ty = function_type(ty, params, param_count, false);
+            free(params);
             continue;
         }
         break;
@@ -1304,29 +1399,29 @@ static Type *function_pointer_type()
     if (!consume(")"))
         return NULL;
 
-    // Create the function type
-    Type *func_type = function_type(base_type);
-
     // Now expect parameter list: (type, type, ...)
     if (!consume("("))
         return NULL;
 
     // Parse parameter types
+    Type **params = NULL;
+    int param_count = 0;
     if (!consume(")"))
     {
-        // First parameter is always int for now
-        add_param_type(func_type, int_type(false));
-
-        // Parse comma-separated parameter list
-        while (consume(","))
+        // Parameters are always int for now
+        do
         {
-            // Additional parameters are always int for now
-            add_param_type(func_type, int_type(false));
-        }
+            params = realloc(params, sizeof(Type *) * (param_count + 1));
+            params[param_count++] = int_type(false);
+        } while (consume(","));
 
         expect(")");
     }
 
+    // Create the function type
+    Type *func_type = function_type(base_type, params, param_count, false);
+    free(params);
+
     // Return a pointer to the function type
     return pointer_to(func_type);
 }
@@ -1335,8 +1430,7 @@ static Type *function_pointer_type()
 static Node *function_pointer_call(Function *fn, Node *func_ptr)
 {
     // Create a function pointer call node
-    Node *node = calloc(1, sizeof(Node));
-    node->kind = ND_FUNC_PTR_CALL;
+    Node *node = alloc_node(ND_FUNC_PTR_CALL);
     node->lhs = func_ptr; // The function pointer expression
 
     // Parse arguments
@@ -1385,85 +1479,106 @@ static Node *function_pointer_call(Function *fn, Node *func_ptr)
     return node;
 }
 
-// Typedef table (simple linked list for now)
-typedef struct TypedefEntry
-{
-    struct TypedefEntry *next;
-    char *name;
-    Type *type;
-} TypedefEntry;
-static TypedefEntry *typedef_table = NULL;
+// Typedefs, newest first, for writing precompiled headers; lookups go
+// through the global symbol table
+TypedefEntry *typedef_table = NULL;
 
-static void add_typedef(const char *name, Type *type)
+void add_typedef(const char *name, Type *type)
 {
     TypedefEntry *entry = calloc(1, sizeof(TypedefEntry));
-    entry->name = strdup(name);
+    entry->name = name;
     entry->type = type;
     entry->next = typedef_table;
     typedef_table = entry;
+    global_symbol(name)->typedef_type = type;
 }
 
+// name must be interned
 static Type *find_typedef(const char *name)
 {
-    for (TypedefEntry *entry = typedef_table; entry; entry = entry->next)
-    {
-        if (strcmp(entry->name, name) == 0)
-            return entry->type;
-    }
-    return NULL;
+    GlobalSymbol *sym = global_lookup(name);
+    return sym ? sym->typedef_type : NULL;
 }
 
-// Union declaration
+// Union declaration, after the "union" keyword
 static Type *union_decl()
 {
-    fprintf(stderr, "[DEBUG] Entering union_decl, token kind: %d, str: '%s'\n", token->kind, token->str ? token->str : "(null)");
+    TRACE(TRACE_PARSE, 2, "entering union_decl, token kind: %d, str: '%.*s'", token->kind, token->len, token->str);
     if (at_eof() || token->kind == TK_EOF)
         return NULL;
-    expect("union");
     Token *tag = consume_ident();
-    Type *ty = calloc(1, sizeof(Type));
-    ty->kind = TY_UNION;
-    expect("{");
+    if (tag && !consume("{"))
+        return tag_type(tag, TY_UNION);
+    Type *ty;
+    if (tag)
+    {
+        ty = tag_type(tag, TY_UNION);
+        if (ty->members)
+            error_at(tag, "redefinition of union '%.*s'", tag->len, tag->str);
+    }
+    else
+    {
+        ty = calloc(1, sizeof(Type));
+        ty->kind = TY_UNION;
+        expect("{");
+    }
     Member head = {};
     Member *cur = &head;
     int max_size = 0;
     while (!consume("}"))
     {
+        if (at_eof())
+        {
+            error_at(token, "expected '}', but got EOF");
+            break;
+        }
         Type *member_type = type_specifier();
-        char *member_name;
-        int member_len;
-        Type *full_member_type = parse_declarator(member_type, &member_name, &member_len);
-        Member *mem = calloc(1, sizeof(Member));
-        mem->name = my_strndup(member_name, member_len);
-        mem->ty = full_member_type;
-        if (consume("["))
+        if (!member_type)
         {
-            int size = expect_number();
-            expect("]");
-            mem->ty = array_of(full_member_type, size);
+            error_at(token, "expected member type, got '%.*s'", token->len, token->str);
+            member_type = int_type(false);
         }
-        mem->offset = 0; // All members start at offset 0
-        int member_size = size_of(mem->ty);
-        if (member_size > max_size)
-            max_size = member_size;
-        cur->next = mem;
-        cur = mem;
+        do
+        {
+            const char *member_name;
+            int member_len;
+            Type *full_member_type = parse_declarator(member_type, &member_name, &member_len);
+            Member *mem = calloc(1, sizeof(Member));
+            mem->name = member_name;
+            mem->ty = full_member_type;
+            if (consume("["))
+            {
+                int size = expect_number();
+                expect("]");
+                mem->ty = array_of(full_member_type, size);
+            }
+            mem->offset = 0; // All members start at offset 0
+            int member_size = size_of(mem->ty);
+            if (member_size > max_size)
+                max_size = member_size;
+            cur->next = mem;
+            cur = mem;
+        } while (consume(","));
         expect(";");
     }
     ty->members = head.next;
+    index_members(ty);
     ty->size = max_size;
     return ty;
 }
 
-// Enum declaration
+// Enum declaration, after the "enum" keyword
 static Type *enum_decl()
 {
-    fprintf(stderr, "[DEBUG] Entering enum_decl, token kind: %d, str: '%s'\n", token->kind, token->str ? token->str : "(null)");
+    TRACE(TRACE_PARSE, 2, "entering enum_decl, token kind: %d, str: '%.*s'", token->kind, token->len, token->str);
     if (at_eof() || token->kind == TK_EOF)
         return NULL;
-    expect("enum");
-    Token *tag = consume_ident();
-    expect("{");
+    Token *tag_tok = consume_ident();
+    if (tag_tok && !consume("{"))
+        return tag_type(tag_tok, TY_ENUM);
+    const char *tag = tag_tok ? tag_tok->name : NULL;
+    if (!tag_tok)
+        expect("{");
     EnumConst *head = NULL, *last = NULL;
     int value = 0;
     while (!consume("}"))
@@ -1482,9 +1597,12 @@ static Type *enum_decl()
             last->next = ec;
         last = ec;
         if (!consume(","))
+        {
+            expect("}");
             break;
+        }
     }
-    Type *ty = enum_type(tag ? my_strndup(tag->str, tag->len) : NULL);
+    Type *ty = tag_tok ? tag_type(tag_tok, TY_ENUM) : enum_type(tag);
     ty->enum_consts = head;
     return ty;
 }
\ No newline at end of file
@@ -0,0 +1,1033 @@
+// pch.c - Precompiled header images
+//
+// "lawsa --pch out.lpch prelude.h" preprocesses and parses a header once
+// and saves what later compiles need from it: the macro table, the typedef
+// table and the header's token stream, with the text of the files the tokens
+// came from. "--include-pch out.lpch" maps that image and adopts all three
+// before the main file is read, so the header is neither preprocessed nor
+// lexed again.
+//
+// The image holds no pointers. Strings are offsets into a pool, and types,
+// members and tokens refer to each other by index. Macro values and token
+// text are used straight from the mapping; types are rebuilt in a single pass
+// over their records. Typedef declarations are left out of the adopted token
+// stream because the typedefs they declare are already in the table.
+//
+// Each built-in header also comes with an image, made at build time by
+// header_image and compiled in next to its text, so "#include <stdio.h>"
+// is neither preprocessed nor lexed either. Such an image holds the #define
+// and #undef lines its files ran, in order, instead of the final macro
+// table, and the first lookup of each macro name by each file, so that
+// pch_include() can tell whether the header would come out the same where
+// it is included.
+#include "lawsa.h"
+#include "preprocess.h"
+
+#define PCH_MAGIC "LPCH"
+#define PCH_VERSION 3
+#define PCH_ALIGN 8
+
+// Sections of the image, each an array of records
+enum
+{
+    PCH_STRINGS,  // NUL-terminated strings; offset 0 stands for NULL
+    PCH_MACROS,   // PchMacro
+    PCH_TYPES,    // PchType
+    PCH_MEMBERS,  // PchMember
+    PCH_ENUMS,    // PchEnum
+    PCH_INDICES,  // uint32_t lists: macro parameter names, function parameter types
+    PCH_TYPEDEFS, // PchTypedef, newest first
+    PCH_TOKENS,   // PchToken, without the final EOF
+    PCH_FILES,    // PchFile
+    PCH_DEFINES,  // PchMacro per #define or #undef run, for built-in headers
+    PCH_LOOKUPS,  // PchLookup, for built-in headers
+    PCH_NSECTIONS,
+};
+
+typedef struct
+{
+    uint32_t offset; // From the start of the image
+    uint32_t count;  // Records
+} PchSection;
+
+typedef struct
+{
+    char magic[4];
+    uint32_t version;
+    PchSection sections[PCH_NSECTIONS];
+} PchHeader;
+
+typedef struct
+{
+    uint32_t name;   // String
+    uint32_t value;  // String
+    uint32_t params; // First index, each a string
+    uint32_t param_count;
+    uint32_t is_function;
+    uint32_t file; // File record plus one of a #define or #undef, or 0
+    uint32_t src;  // String offset of the value in that file's text, or 0
+} PchMacro;
+
+// A type reference is its record index plus one, or 0 for none
+typedef struct
+{
+    uint32_t kind;
+    int32_t size, align;
+    uint32_t qualifiers; // PCH_CONST | PCH_VOLATILE | ...
+    uint32_t ptr_to;
+    int32_t array_size, element_size;
+    uint32_t members, member_len; // First record and length of the list
+    int32_t member_count;
+    uint32_t tag;
+    uint32_t enum_consts, enum_len; // First record and length of the list
+    int32_t enum_const_count;
+    uint32_t enum_tag;
+    uint32_t typedef_name;
+    uint32_t typedef_type;
+    uint32_t return_type;
+    uint32_t params; // First index, each a type reference
+    int32_t param_count;
+    uint32_t is_variadic;
+    uint32_t name;
+} PchType;
+
+#define PCH_CONST 1
+#define PCH_VOLATILE 2
+#define PCH_SIGNED 4
+#define PCH_UNSIGNED 8
+
+typedef struct
+{
+    uint32_t ty; // Type reference
+    uint32_t name;
+    int32_t offset, bit_width, bit_offset;
+} PchMember;
+
+typedef struct
+{
+    uint32_t name;
+    int32_t value;
+} PchEnum;
+
+typedef struct
+{
+    uint32_t name;
+    uint32_t type;     // Type reference
+    uint32_t decl;     // First token of the declaration
+    uint32_t decl_end; // Token after it; equal to decl if there is none
+} PchTypedef;
+
+typedef struct
+{
+    uint32_t kind;
+    int32_t val;
+    uint32_t str;  // String offset, usually inside a file's text
+    uint32_t len;
+    uint32_t file; // File record plus one, or 0 for none
+} PchToken;
+
+// A source file that tokens point into
+typedef struct
+{
+    uint32_t name; // String
+    uint32_t text; // String
+} PchFile;
+
+// The first lookup of a macro name by one file of a built-in header
+typedef struct
+{
+    uint32_t file;   // File record plus one
+    uint32_t name;   // String
+    uint32_t define; // PCH_DEFINES record plus one of the definition found, or 0
+} PchLookup;
+
+static const size_t pch_record_size[PCH_NSECTIONS] = {
+    [PCH_STRINGS] = 1,
+    [PCH_MACROS] = sizeof(PchMacro),
+    [PCH_TYPES] = sizeof(PchType),
+    [PCH_MEMBERS] = sizeof(PchMember),
+    [PCH_ENUMS] = sizeof(PchEnum),
+    [PCH_INDICES] = sizeof(uint32_t),
+    [PCH_TYPEDEFS] = sizeof(PchTypedef),
+    [PCH_TOKENS] = sizeof(PchToken),
+    [PCH_FILES] = sizeof(PchFile),
+    [PCH_DEFINES] = sizeof(PchMacro),
+    [PCH_LOOKUPS] = sizeof(PchLookup),
+};
+
+// Growable byte buffer, one per section while writing
+typedef struct
+{
+    char *data;
+    size_t len;
+    size_t cap;
+} PchBuf;
+
+// Slot of the pointer-keyed maps below
+typedef struct
+{
+    const void *key;
+    uint32_t value;
+} PchSlot;
+
+typedef struct
+{
+    PchBuf sec[PCH_NSECTIONS];
+    PtrTable strings; // String -> pool offset
+    PtrTable types;   // Type -> type reference
+    PtrTable tokens;  // Token -> index
+    PtrTable files;   // File text -> file record plus one
+    Type **pending; // Types by record index, filled in after being numbered
+    uint32_t pending_cap;
+} PchWriter;
+
+static uint32_t pch_append(PchBuf *b, const void *p, size_t n)
+{
+    if (b->len + n > b->cap)
+    {
+        while (b->len + n > b->cap)
+            b->cap = b->cap ? b->cap * 2 : 4096;
+        b->data = realloc(b->data, b->cap);
+        if (!b->data)
+        {
+            fprintf(stderr, "pch: out of memory\n");
+            exit(1);
+        }
+    }
+    uint32_t at = b->len;
+    memcpy(b->data + at, p, n);
+    b->len += n;
+    return at;
+}
+
+static uint32_t pch_count(PchWriter *w, int sec)
+{
+    return w->sec[sec].len / pch_record_size[sec];
+}
+
+// Adds s to the pool once per pointer; NULL is offset 0
+static uint32_t pch_string(PchWriter *w, const char *s)
+{
+    if (!s)
+        return 0;
+    bool added;
+    PchSlot *slot = ptr_table_put(&w->strings, s, &added);
+    if (added)
+        slot->value = pch_append(&w->sec[PCH_STRINGS], s, strlen(s) + 1);
+    return slot->value;
+}
+
+// Numbers a type on first sight; its record is written by pch_fill_type()
+static uint32_t pch_type_ref(PchWriter *w, Type *ty)
+{
+    if (!ty)
+        return 0;
+    bool added;
+    PchSlot *slot = ptr_table_put(&w->types, ty, &added);
+    if (!added)
+        return slot->value;
+    uint32_t index = pch_count(w, PCH_TYPES);
+    PchType blank = {0};
+    pch_append(&w->sec[PCH_TYPES], &blank, sizeof(blank));
+    if (index >= w->pending_cap)
+    {
+        w->pending_cap = w->pending_cap ? w->pending_cap * 2 : 64;
+        w->pending = realloc(w->pending, w->pending_cap * sizeof(Type *));
+    }
+    w->pending[index] = ty;
+    slot->value = index + 1;
+    return slot->value;
+}
+
+static void pch_fill_type(PchWriter *w, uint32_t index)
+{
+    Type *ty = w->pending[index];
+    PchType rec = {0};
+    rec.kind = ty->kind;
+    rec.size = ty->size;
+    rec.align = ty->align;
+    rec.qualifiers = (ty->qualifiers.is_const ? PCH_CONST : 0) |
+                     (ty->qualifiers.is_volatile ? PCH_VOLATILE : 0) |
+                     (ty->qualifiers.is_signed ? PCH_SIGNED : 0) |
+                     (ty->qualifiers.is_unsigned ? PCH_UNSIGNED : 0);
+    rec.ptr_to = pch_type_ref(w, ty->ptr_to);
+    rec.array_size = ty->array_size;
+    rec.element_size = ty->element_size;
+    rec.member_count = ty->member_count;
+    rec.tag = pch_string(w, ty->tag);
+    rec.enum_const_count = ty->enum_const_count;
+    rec.enum_tag = pch_string(w, ty->enum_tag);
+    rec.typedef_name = pch_string(w, ty->typedef_name);
+    rec.typedef_type = pch_type_ref(w, ty->typedef_type);
+    rec.return_type = pch_type_ref(w, ty->return_type);
+    rec.param_count = ty->param_count;
+    rec.is_variadic = ty->is_variadic;
+    rec.name = pch_string(w, ty->name);
+
+    // Numbering member types only appends type records, so each list stays
+    // contiguous
+    rec.members = pch_count(w, PCH_MEMBERS);
+    for (Member *m = ty->members; m; m = m->next, rec.member_len++)
+    {
+        PchMember mr = {pch_type_ref(w, m->ty), pch_string(w, m->name), m->offset, m->bit_width, m->bit_offset};
+        pch_append(&w->sec[PCH_MEMBERS], &mr, sizeof(mr));
+    }
+    rec.enum_consts = pch_count(w, PCH_ENUMS);
+    for (EnumConst *e = ty->enum_consts; e; e = e->next, rec.enum_len++)
+    {
+        PchEnum er = {pch_string(w, e->name), e->value};
+        pch_append(&w->sec[PCH_ENUMS], &er, sizeof(er));
+    }
+    // Parameter references are gathered first since numbering them may add
+    // to the index list too
+    uint32_t *refs = calloc(ty->param_count + 1, sizeof(uint32_t));
+    for (int i = 0; i < ty->param_count && ty->params; i++)
+        refs[i] = pch_type_ref(w, ty->params[i]);
+    rec.params = pch_count(w, PCH_INDICES);
+    if (ty->params)
+        pch_append(&w->sec[PCH_INDICES], refs, ty->param_count * sizeof(uint32_t));
+    free(refs);
+
+    memcpy(w->sec[PCH_TYPES].data + index * sizeof(PchType), &rec, sizeof(rec));
+}
+
+static PchMacro *pch_macro_record(PchWriter *w, int sec, const char *name, const char *value, bool is_function,
+                                  const char **params, int param_count, uint32_t file)
+{
+    PchMacro rec = {pch_string(w, name), pch_string(w, value), 0, param_count, is_function, file, 0};
+    uint32_t *names = calloc(param_count + 1, sizeof(uint32_t));
+    for (int i = 0; i < param_count; i++)
+        names[i] = pch_string(w, params[i]);
+    rec.params = pch_count(w, PCH_INDICES);
+    pch_append(&w->sec[PCH_INDICES], names, param_count * sizeof(uint32_t));
+    free(names);
+    uint32_t at = pch_append(&w->sec[sec], &rec, sizeof(rec));
+    return (PchMacro *)(w->sec[sec].data + at);
+}
+
+static void pch_add_macro(void *ctx, const char *name, const char *value, bool is_function,
+                          const char **params, int param_count)
+{
+    pch_macro_record(ctx, PCH_MACROS, name, value, is_function, params, param_count, 0);
+}
+
+static uint32_t pch_token_index(PchWriter *w, Token *tok)
+{
+    PchSlot *slot = ptr_table_find(&w->tokens, tok);
+    return slot ? slot->value : 0;
+}
+
+// Returns the record plus one of a source file, adding it with its text on
+// first use, or 0 if the file has no text
+static uint32_t pch_file(PchWriter *w, int file_id)
+{
+    const char *text = source_file_text(file_id);
+    if (!text)
+        return 0;
+    bool added;
+    PchSlot *slot = ptr_table_put(&w->files, text, &added);
+    if (added)
+    {
+        PchFile file = {pch_string(w, source_file_name(file_id)), pch_string(w, text)};
+        pch_append(&w->sec[PCH_FILES], &file, sizeof(file));
+        slot->value = pch_count(w, PCH_FILES);
+    }
+    return slot->value;
+}
+
+// Stores tok's text and file in rec. Tokens point into their file's text,
+// which is stored once; others get a copy of their own.
+static void pch_token_text(PchWriter *w, Token *tok, PchToken *rec)
+{
+    const char *text = source_file_text(tok->file_id);
+    if (text)
+    {
+        rec->file = pch_file(w, tok->file_id);
+        const PchFile *file = (const PchFile *)w->sec[PCH_FILES].data + rec->file - 1;
+        rec->str = file->text + (tok->str - text);
+        return;
+    }
+    rec->str = pch_append(&w->sec[PCH_STRINGS], tok->str, tok->len);
+    pch_append(&w->sec[PCH_STRINGS], "", 1);
+}
+
+// A #define or #undef run while a built-in header's image was being made
+typedef struct
+{
+    int file; // Source file of the line
+    const char *name;
+    char *value;         // Copy, or NULL for #undef
+    const char **params; // Copy
+    int param_count;
+    bool is_function;
+    long src; // Offset of the value in the file's text, or -1
+} PchDefineEvent;
+
+// A name looked up for the first time by one file
+typedef struct
+{
+    int file; // Source file
+    const char *name;
+    int define; // Index plus one of the #define found, or 0 if none
+} PchLookupEvent;
+
+static PchDefineEvent *watch_defines;
+static int watch_define_count;
+static int watch_define_cap;
+static PchLookupEvent *watch_lookups;
+static int watch_lookup_count;
+static int watch_lookup_cap;
+static PtrTable watch_latest = PTR_TABLE(PchSlot); // Name -> its last #define or #undef plus one
+static PtrTable *watch_seen;                      // Names each source file has looked up
+static int watch_seen_count;
+
+static void *pch_grow(void *data, int count, int *cap, size_t size)
+{
+    if (count < *cap)
+        return data;
+    *cap = *cap ? *cap * 2 : 64;
+    data = realloc(data, *cap * size);
+    if (!data)
+    {
+        fprintf(stderr, "pch: out of memory\n");
+        exit(1);
+    }
+    return data;
+}
+
+static void pch_watch(const char *atom, const MacroDef *m, bool defining)
+{
+    int file = pp_current_file();
+    if (file < 0)
+        return;
+    if (defining)
+    {
+        watch_defines = pch_grow(watch_defines, watch_define_count, &watch_define_cap, sizeof(PchDefineEvent));
+        PchDefineEvent *d = &watch_defines[watch_define_count++];
+        *d = (PchDefineEvent){.file = file, .name = atom, .src = -1};
+        if (m)
+        {
+            if (m->src && m->src_file == file)
+                d->src = m->src - source_file_text(file);
+            size_t len = strlen(m->value);
+            d->value = malloc(len + 1);
+            memcpy(d->value, m->value, len + 1);
+            d->params = calloc(m->param_count + 1, sizeof(char *));
+            for (int i = 0; i < m->param_count; i++)
+                d->params[i] = m->params[i];
+            d->param_count = m->param_count;
+            d->is_function = m->is_function;
+        }
+        ((PchSlot *)ptr_table_put(&watch_latest, atom, NULL))->value = watch_define_count;
+        return;
+    }
+    while (file >= watch_seen_count)
+    {
+        int cap = watch_seen_count;
+        watch_seen = pch_grow(watch_seen, watch_seen_count, &cap, sizeof(PtrTable));
+        while (watch_seen_count < cap)
+            watch_seen[watch_seen_count++] = (PtrTable)PTR_TABLE(PchSlot);
+    }
+    bool added;
+    ptr_table_put(&watch_seen[file], atom, &added);
+    if (!added)
+        return;
+    PchSlot *latest = ptr_table_find(&watch_latest, atom);
+    watch_lookups = pch_grow(watch_lookups, watch_lookup_count, &watch_lookup_cap, sizeof(PchLookupEvent));
+    watch_lookups[watch_lookup_count++] = (PchLookupEvent){file, atom, m && latest ? (int)latest->value : 0};
+}
+
+// Records what the preprocessor does with macros from here on, for the
+// image of a built-in header (header_image.c). pch_write() saves it in place
+// of the macro table.
+void pch_watch_macros(void)
+{
+    macro_watch = pch_watch;
+}
+
+// Writes the image for a header that was preprocessed into tokens and then
+// parsed. The macro and typedef tables are taken as they stand. Returns
+// false if the file cannot be written.
+bool pch_write(const char *path, Token *tokens)
+{
+    PchWriter w = {
+        .strings = PTR_TABLE(PchSlot),
+        .types = PTR_TABLE(PchSlot),
+        .tokens = PTR_TABLE(PchSlot),
+        .files = PTR_TABLE(PchSlot),
+    };
+    pch_append(&w.sec[PCH_STRINGS], "", 1);
+    PchHeader h = {.version = PCH_VERSION};
+    memcpy(h.magic, PCH_MAGIC, 4);
+
+    uint32_t ntokens = 0;
+    Token *tok = tokens;
+    for (; tok && tok->kind != TK_EOF; tok = tok->next, ntokens++)
+    {
+        PchToken rec = {tok->kind, tok->kind == TK_IDENT ? 0 : tok->val, 0, tok->len, 0};
+        pch_token_text(&w, tok, &rec);
+        pch_append(&w.sec[PCH_TOKENS], &rec, sizeof(rec));
+        ((PchSlot *)ptr_table_put(&w.tokens, tok, NULL))->value = ntokens;
+    }
+    if (tok)
+        ((PchSlot *)ptr_table_put(&w.tokens, tok, NULL))->value = ntokens;
+
+    if (macro_watch == pch_watch)
+    {
+        for (int i = 0; i < watch_define_count; i++)
+        {
+            PchDefineEvent *d = &watch_defines[i];
+            uint32_t file = pch_file(&w, d->file);
+            PchMacro *rec = pch_macro_record(&w, PCH_DEFINES, d->name, d->value, d->is_function, d->params,
+                                             d->param_count, file);
+            if (file && d->src >= 0)
+                rec->src = ((const PchFile *)w.sec[PCH_FILES].data)[file - 1].text + d->src;
+        }
+        for (int i = 0; i < watch_lookup_count; i++)
+        {
+            PchLookupEvent *l = &watch_lookups[i];
+            PchLookup rec = {pch_file(&w, l->file), pch_string(&w, l->name), l->define};
+            pch_append(&w.sec[PCH_LOOKUPS], &rec, sizeof(rec));
+        }
+    }
+    else
+        macro_foreach(pch_add_macro, &w);
+
+    for (TypedefEntry *td = typedef_table; td; td = td->next)
+    {
+        PchTypedef rec = {pch_string(&w, td->name), pch_type_ref(&w, td->type), 0, 0};
+        if (td->decl && td->decl_end)
+        {
+            rec.decl = pch_token_index(&w, td->decl);
+            rec.decl_end = pch_token_index(&w, td->decl_end);
+        }
+        pch_append(&w.sec[PCH_TYPEDEFS], &rec, sizeof(rec));
+    }
+    // Filling a type may number more types behind it
+    for (uint32_t i = 0; i < pch_count(&w, PCH_TYPES); i++)
+        pch_fill_type(&w, i);
+
+    uint32_t offset = (sizeof(PchHeader) + PCH_ALIGN - 1) & ~(PCH_ALIGN - 1);
+    for (int i = 0; i < PCH_NSECTIONS; i++)
+    {
+        h.sections[i].offset = offset;
+        h.sections[i].count = pch_count(&w, i);
+        offset += (w.sec[i].len + PCH_ALIGN - 1) & ~(PCH_ALIGN - 1);
+    }
+
+    FILE *fp = fopen(path, "wb");
+    if (!fp)
+    {
+        error("Could not write precompiled header: %s", path);
+        return false;
+    }
+    static const char pad[PCH_ALIGN];
+    fwrite(&h, sizeof(h), 1, fp);
+    fwrite(pad, 1, h.sections[0].offset - sizeof(h), fp);
+    for (int i = 0; i < PCH_NSECTIONS; i++)
+    {
+        fwrite(w.sec[i].data, 1, w.sec[i].len, fp);
+        fwrite(pad, 1, -w.sec[i].len & (PCH_ALIGN - 1), fp);
+        free(w.sec[i].data);
+    }
+    bool ok = !ferror(fp);
+    ok &= fclose(fp) == 0;
+    if (!ok)
+        error("Could not write precompiled header: %s", path);
+    TRACE(TRACE_DRIVER, 1, "wrote %s: %u macros, %u typedefs, %u types, %u tokens", path,
+          h.sections[PCH_MACROS].count + h.sections[PCH_DEFINES].count, h.sections[PCH_TYPEDEFS].count,
+          h.sections[PCH_TYPES].count, h.sections[PCH_TOKENS].count);
+    ptr_table_free(&w.strings);
+    ptr_table_free(&w.types);
+    ptr_table_free(&w.tokens);
+    ptr_table_free(&w.files);
+    free(w.pending);
+    return ok;
+}
+
+// Finds loops among the references of pointer, array, function and typedef
+// types, which would never end when followed. state: 0 unseen, 1 on the
+// current path, 2 done.
+static bool pch_type_acyclic(const PchType *recs, const uint32_t *indices, uint32_t ref, uint8_t *state)
+{
+    if (!ref || state[ref - 1] == 2)
+        return true;
+    if (state[ref - 1] == 1)
+        return false;
+    state[ref - 1] = 1;
+    const PchType *r = &recs[ref - 1];
+    bool ok = true;
+    if (r->kind == TY_PTR || r->kind == TY_ARRAY)
+        ok = pch_type_acyclic(recs, indices, r->ptr_to, state);
+    else if (r->kind == TY_TYPEDEF)
+        ok = pch_type_acyclic(recs, indices, r->typedef_type, state);
+    else if (r->kind == TY_FUNC)
+    {
+        ok = pch_type_acyclic(recs, indices, r->return_type, state);
+        for (int32_t i = 0; ok && i < r->param_count; i++)
+            ok = pch_type_acyclic(recs, indices, indices[r->params + i], state);
+    }
+    state[ref - 1] = 2;
+    return ok;
+}
+
+// Checks every field pch_load() and pch_include() use as an index: string offsets against
+// the pool, record ranges against their sections, type references against
+// the type records, and kinds against their enums. Sections are already
+// known to lie inside the image.
+static bool pch_check(const PchHeader *h)
+{
+    const char *base = (const char *)h;
+#define PCH_SECTION(i, T) ((const T *)(base + h->sections[i].offset))
+#define PCH_COUNT(i) h->sections[i].count
+#define OPT_STR_OK(off) ((off) < PCH_COUNT(PCH_STRINGS)) // NULL allowed
+#define STR_OK(off) ((off) && OPT_STR_OK(off))
+#define TYPE_OK(ref) ((ref) <= PCH_COUNT(PCH_TYPES))
+#define RANGE_OK(first, len, i) ((uint64_t)(first) + (uint64_t)(len) <= PCH_COUNT(i))
+    // A NUL at the end of the pool ends every string inside it
+    const char *strings = PCH_SECTION(PCH_STRINGS, char);
+    if (!PCH_COUNT(PCH_STRINGS) || strings[PCH_COUNT(PCH_STRINGS) - 1])
+        return false;
+    const uint32_t *indices = PCH_SECTION(PCH_INDICES, uint32_t);
+    const PchFile *files = PCH_SECTION(PCH_FILES, PchFile);
+    for (uint32_t i = 0; i < PCH_COUNT(PCH_FILES); i++)
+        if (!STR_OK(files[i].name) || !OPT_STR_OK(files[i].text))
+            return false;
+
+    // Token text and macro values placed in a file's text stay inside it
+    uint32_t *text_end = calloc(PCH_COUNT(PCH_FILES) + 1, sizeof(uint32_t));
+    for (uint32_t i = 0; i < PCH_COUNT(PCH_FILES); i++)
+        if (files[i].text)
+            text_end[i] = files[i].text + strlen(strings + files[i].text);
+#define IN_TEXT(file, off, len)                                                                              \
+    ((file) <= PCH_COUNT(PCH_FILES) &&                                                                     \
+     (!(file) || (files[(file) - 1].text && (off) >= files[(file) - 1].text &&                              \
+                  (uint64_t)(off) + (len) <= text_end[(file) - 1])))
+    bool ok = true;
+    const PchToken *tokens = PCH_SECTION(PCH_TOKENS, PchToken);
+    for (uint32_t i = 0; ok && i < PCH_COUNT(PCH_TOKENS); i++)
+    {
+        const PchToken *t = &tokens[i];
+        ok = t->kind <= TK_KEYWORD && STR_OK(t->str) && RANGE_OK(t->str, t->len, PCH_STRINGS) &&
+             IN_TEXT(t->file, t->str, t->len);
+    }
+    // Only #undef records have no value
+    static const int macro_sections[] = {PCH_MACROS, PCH_DEFINES};
+    for (int k = 0; ok && k < 2; k++)
+    {
+        int sec = macro_sections[k];
+        const PchMacro *macros = PCH_SECTION(sec, PchMacro);
+        for (uint32_t i = 0; ok && i < PCH_COUNT(sec); i++)
+        {
+            const PchMacro *m = &macros[i];
+            ok = STR_OK(m->name) && (sec == PCH_DEFINES ? OPT_STR_OK(m->value) : STR_OK(m->value)) &&
+                 IN_TEXT(m->file, m->src, 0) && (!m->src || m->file) &&
+                 RANGE_OK(m->params, m->param_count, PCH_INDICES);
+            for (uint32_t j = 0; ok && j < m->param_count; j++)
+                ok = STR_OK(indices[m->params + j]);
+        }
+    }
+    free(text_end);
+#undef IN_TEXT
+    if (!ok)
+        return false;
+    const PchLookup *lookups = PCH_SECTION(PCH_LOOKUPS, PchLookup);
+    for (uint32_t i = 0; i < PCH_COUNT(PCH_LOOKUPS); i++)
+        if (lookups[i].file > PCH_COUNT(PCH_FILES) || !STR_OK(lookups[i].name) ||
+            lookups[i].define > PCH_COUNT(PCH_DEFINES))
+            return false;
+
+    const PchType *types = PCH_SECTION(PCH_TYPES, PchType);
+    for (uint32_t i = 0; i < PCH_COUNT(PCH_TYPES); i++)
+    {
+        const PchType *r = &types[i];
+        if (r->kind > TY_TYPEDEF || !TYPE_OK(r->ptr_to) || !TYPE_OK(r->typedef_type) || !TYPE_OK(r->return_type))
+            return false;
+        if ((r->kind == TY_PTR || r->kind == TY_ARRAY) && !r->ptr_to)
+            return false;
+        if (r->kind == TY_TYPEDEF && !r->typedef_type)
+            return false;
+        if (!OPT_STR_OK(r->tag) || !OPT_STR_OK(r->enum_tag) || !OPT_STR_OK(r->typedef_name) || !OPT_STR_OK(r->name))
+            return false;
+        if (!RANGE_OK(r->members, r->member_len, PCH_MEMBERS) || !RANGE_OK(r->enum_consts, r->enum_len, PCH_ENUMS))
+            return false;
+        if (r->param_count < 0 || !RANGE_OK(r->params, r->param_count, PCH_INDICES))
+            return false;
+        for (int32_t j = 0; j < r->param_count; j++)
+            if (!TYPE_OK(indices[r->params + j]))
+                return false;
+    }
+
+    const PchMember *members = PCH_SECTION(PCH_MEMBERS, PchMember);
+    for (uint32_t i = 0; i < PCH_COUNT(PCH_MEMBERS); i++)
+        if (!TYPE_OK(members[i].ty) || !OPT_STR_OK(members[i].name))
+            return false;
+    const PchEnum *enums = PCH_SECTION(PCH_ENUMS, PchEnum);
+    for (uint32_t i = 0; i < PCH_COUNT(PCH_ENUMS); i++)
+        if (!OPT_STR_OK(enums[i].name))
+            return false;
+    const PchTypedef *typedefs = PCH_SECTION(PCH_TYPEDEFS, PchTypedef);
+    for (uint32_t i = 0; i < PCH_COUNT(PCH_TYPEDEFS); i++)
+        if (!STR_OK(typedefs[i].name) || !TYPE_OK(typedefs[i].type) ||
+            typedefs[i].decl > typedefs[i].decl_end || typedefs[i].decl_end > PCH_COUNT(PCH_TOKENS))
+            return false;
+
+    uint8_t *state = calloc(PCH_COUNT(PCH_TYPES) + 1, 1);
+    for (uint32_t i = 0; ok && i < PCH_COUNT(PCH_TYPES); i++)
+        ok = pch_type_acyclic(types, indices, i + 1, state);
+    free(state);
+    return ok;
+#undef PCH_SECTION
+#undef PCH_COUNT
+#undef OPT_STR_OK
+#undef STR_OK
+#undef TYPE_OK
+#undef RANGE_OK
+}
+
+// Returns the header of the image of len bytes at base, or NULL if that is
+// not an image for this version of lawsa
+static const PchHeader *pch_header(const void *base, size_t len)
+{
+    const PchHeader *h = base;
+    bool ok = len >= sizeof(PchHeader) && !memcmp(h->magic, PCH_MAGIC, 4) && h->version == PCH_VERSION;
+    for (int i = 0; ok && i < PCH_NSECTIONS; i++)
+        ok = h->sections[i].offset % PCH_ALIGN == 0 &&
+             h->sections[i].offset + (uint64_t)h->sections[i].count * pch_record_size[i] <= len;
+    return ok && pch_check(h) ? h : NULL;
+}
+
+#define PCH_SECTION(i, T) ((const T *)((const char *)h + h->sections[i].offset))
+#define PCH_STR(off) ((off) ? (char *)PCH_SECTION(PCH_STRINGS, char) + (off) : NULL)
+
+// Defines a macro as its record says, or undefines it for an #undef record.
+// The value stays in the image. Where the record places the value in its
+// file, file_ids and texts give that file's source and text, as for
+// pch_adopt().
+static void pch_adopt_macro(const PchHeader *h, const PchMacro *m, const int *file_ids, const char *const *texts)
+{
+    const uint32_t *indices = PCH_SECTION(PCH_INDICES, uint32_t);
+    const char **params = NULL;
+    if (m->param_count)
+        params = malloc(m->param_count * sizeof(char *));
+    for (uint32_t j = 0; j < m->param_count; j++)
+    {
+        const char *s = PCH_STR(indices[m->params + j]);
+        params[j] = intern(s, strlen(s));
+    }
+    const char *src = NULL;
+    if (m->src && texts && texts[m->file])
+        src = texts[m->file] + (m->src - PCH_SECTION(PCH_FILES, PchFile)[m->file - 1].text);
+    const char *name = PCH_STR(m->name);
+    macro_adopt(intern(name, strlen(name)), PCH_STR(m->value), m->is_function, params, m->param_count, src,
+                src ? file_ids[m->file] : -1);
+}
+
+// Returns whether m is the definition a #define record made
+static bool pch_same_macro(const PchHeader *h, const PchMacro *d, const MacroDef *m)
+{
+    const char *strings = PCH_SECTION(PCH_STRINGS, char);
+    const uint32_t *indices = PCH_SECTION(PCH_INDICES, uint32_t);
+    if (!d->value || strcmp(strings + d->value, m->value) || !d->is_function != !m->is_function ||
+        d->param_count != (uint32_t)m->param_count)
+        return false;
+    for (uint32_t j = 0; j < d->param_count; j++)
+        if (strcmp(strings + indices[d->params + j], m->params[j]))
+            return false;
+    return true;
+}
+
+// Rebuilds the image's types. Types, members and enum constants are
+// allocated in blocks and linked.
+static Type *pch_types(const PchHeader *h)
+{
+    const char *strings = PCH_SECTION(PCH_STRINGS, char);
+    const uint32_t *indices = PCH_SECTION(PCH_INDICES, uint32_t);
+    uint32_t ntypes = h->sections[PCH_TYPES].count;
+    Type *types = calloc(ntypes + 1, sizeof(Type));
+    Member *members = calloc(h->sections[PCH_MEMBERS].count + 1, sizeof(Member));
+    EnumConst *enums = calloc(h->sections[PCH_ENUMS].count + 1, sizeof(EnumConst));
+#define PCH_TYPE(ref) ((ref) ? &types[(ref) - 1] : NULL)
+    const PchType *type_recs = PCH_SECTION(PCH_TYPES, PchType);
+    const PchMember *member_recs = PCH_SECTION(PCH_MEMBERS, PchMember);
+    const PchEnum *enum_recs = PCH_SECTION(PCH_ENUMS, PchEnum);
+    for (uint32_t i = 0; i < ntypes; i++)
+    {
+        const PchType *r = &type_recs[i];
+        Type *ty = &types[i];
+        ty->kind = r->kind;
+        ty->size = r->size;
+        ty->align = r->align;
+        ty->qualifiers.is_const = r->qualifiers & PCH_CONST;
+        ty->qualifiers.is_volatile = r->qualifiers & PCH_VOLATILE;
+        ty->qualifiers.is_signed = r->qualifiers & PCH_SIGNED;
+        ty->qualifiers.is_unsigned = r->qualifiers & PCH_UNSIGNED;
+        ty->ptr_to = PCH_TYPE(r->ptr_to);
+        ty->array_size = r->array_size;
+        ty->element_size = r->element_size;
+        ty->member_count = r->member_count;
+        ty->tag = PCH_STR(r->tag);
+        ty->enum_const_count = r->enum_const_count;
+        if (r->enum_tag)
+        {
+            const char *tag = strings + r->enum_tag;
+            ty->enum_tag = intern(tag, strlen(tag));
+        }
+        ty->typedef_name = PCH_STR(r->typedef_name);
+        ty->typedef_type = PCH_TYPE(r->typedef_type);
+        ty->return_type = PCH_TYPE(r->return_type);
+        ty->param_count = r->param_count;
+        ty->is_variadic = r->is_variadic;
+        ty->name = PCH_STR(r->name);
+
+        for (uint32_t j = 0; j < r->member_len; j++)
+        {
+            const PchMember *mr = &member_recs[r->members + j];
+            Member *m = &members[r->members + j];
+            m->ty = PCH_TYPE(mr->ty);
+            if (mr->name)
+            {
+                const char *name = strings + mr->name;
+                m->name = intern(name, strlen(name));
+            }
+            m->offset = mr->offset;
+            m->bit_width = mr->bit_width;
+            m->bit_offset = mr->bit_offset;
+            m->next = j + 1 < r->member_len ? m + 1 : NULL;
+        }
+        ty->members = r->member_len ? &members[r->members] : NULL;
+        if (ty->kind == TY_STRUCT || ty->kind == TY_UNION)
+            index_members(ty);
+        for (uint32_t j = 0; j < r->enum_len; j++)
+        {
+            EnumConst *e = &enums[r->enum_consts + j];
+            e->name = PCH_STR(enum_recs[r->enum_consts + j].name);
+            e->value = enum_recs[r->enum_consts + j].value;
+            e->next = j + 1 < r->enum_len ? e + 1 : NULL;
+        }
+        ty->enum_consts = r->enum_len ? &enums[r->enum_consts] : NULL;
+        if (r->param_count)
+        {
+            ty->params = calloc(r->param_count, sizeof(Type *));
+            for (int j = 0; j < r->param_count; j++)
+                ty->params[j] = PCH_TYPE(indices[r->params + j]);
+        }
+    }
+#undef PCH_TYPE
+
+    // Builtin, pointer, array and function types are swapped for the
+    // canonical objects, so they are the same types the parser makes
+    for (uint32_t i = 0; i < h->sections[PCH_MEMBERS].count; i++)
+        members[i].ty = canonical_type(members[i].ty);
+    for (uint32_t i = 0; i < ntypes; i++)
+        types[i].typedef_type = canonical_type(types[i].typedef_type);
+    return types;
+}
+
+// Adopts the image's typedefs and returns its tokens in an array of
+// *count, leaving out those of typedef declarations. file_ids has the
+// source file for the tokens of each file record, after the one for tokens
+// with text of their own; a file whose id is -1 is left out, typedefs and
+// all. Tokens point into texts, or into the image where that is NULL.
+static Token *pch_adopt(const PchHeader *h, Type *types, const int *file_ids, const char *const *texts,
+                        uint32_t *count)
+{
+    uint32_t ntokens = h->sections[PCH_TOKENS].count;
+    const PchToken *token_recs = PCH_SECTION(PCH_TOKENS, PchToken);
+    const PchFile *files = PCH_SECTION(PCH_FILES, PchFile);
+    bool *skip = calloc(ntokens + 1, sizeof(bool));
+    for (uint32_t i = 0; i < ntokens; i++)
+        skip[i] = file_ids[token_recs[i].file] < 0;
+
+    // Oldest first, so the table ends up in the order it was built
+    const PchTypedef *typedefs = PCH_SECTION(PCH_TYPEDEFS, PchTypedef);
+    for (uint32_t i = h->sections[PCH_TYPEDEFS].count; i-- > 0;)
+    {
+        const PchTypedef *td = &typedefs[i];
+        if (td->decl < td->decl_end && skip[td->decl])
+            continue;
+        const char *name = PCH_STR(td->name);
+        add_typedef(intern(name, strlen(name)), canonical_type(td->type ? &types[td->type - 1] : NULL));
+        for (uint32_t j = td->decl; j < td->decl_end; j++)
+            skip[j] = true;
+    }
+
+    Token *tokens = calloc(ntokens + 1, sizeof(Token));
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < ntokens; i++)
+    {
+        if (skip[i])
+            continue;
+        const PchToken *r = &token_recs[i];
+        Token *tok = &tokens[n++];
+        tok->kind = r->kind;
+        if (texts && texts[r->file])
+            tok->str = (char *)texts[r->file] + (r->str - files[r->file - 1].text);
+        else
+            tok->str = PCH_STR(r->str);
+        tok->len = r->len;
+        tok->file_id = file_ids[r->file];
+        if (r->kind == TK_IDENT)
+            tok->name = intern(tok->str, tok->len);
+        else
+            tok->val = r->val;
+    }
+    free(skip);
+    *count = n;
+    return tokens;
+}
+
+// The loaded image stays mapped for the whole process
+static SourceBuffer pch_image;
+static Token *pch_first, *pch_last;
+
+// Maps a precompiled header and adopts its macros and typedefs. Its tokens
+// are put in front of the main file's by pch_prepend(). Returns false, after
+// reporting why, if the image cannot be used.
+bool pch_load(const char *path)
+{
+    if (!source_open(&pch_image, path))
+    {
+        error("Could not open precompiled header: %s", path);
+        return false;
+    }
+    const PchHeader *h = pch_header(pch_image.data, pch_image.len);
+    if (!h)
+    {
+        error("%s is not a precompiled header for this version of lawsa", path);
+        return false;
+    }
+
+    // Macros keep their values in the image
+    const PchMacro *macros = PCH_SECTION(PCH_MACROS, PchMacro);
+    for (uint32_t i = 0; i < h->sections[PCH_MACROS].count; i++)
+        pch_adopt_macro(h, &macros[i], NULL, NULL);
+
+    // Each file gets a source entry of its own, apart from any later read
+    // of the same file
+    uint32_t nfiles = h->sections[PCH_FILES].count;
+    int *file_ids = calloc(nfiles + 1, sizeof(int));
+    const PchFile *files = PCH_SECTION(PCH_FILES, PchFile);
+    file_ids[0] = source_file_add("<precompiled>", NULL);
+    for (uint32_t i = 0; i < nfiles; i++)
+        file_ids[i + 1] = source_file_add(PCH_STR(files[i].name), PCH_STR(files[i].text));
+    uint32_t ntokens;
+    Token *tokens = pch_adopt(h, pch_types(h), file_ids, NULL, &ntokens);
+    free(file_ids);
+    for (uint32_t i = 0; i < ntokens; i++)
+        tokens[i].next = i + 1 < ntokens ? &tokens[i + 1] : NULL;
+    if (ntokens)
+    {
+        pch_first = tokens;
+        pch_last = &tokens[ntokens - 1];
+    }
+    TRACE(TRACE_DRIVER, 1, "loaded %s: %u macros, %u typedefs, %u tokens", path,
+          h->sections[PCH_MACROS].count, h->sections[PCH_TYPEDEFS].count, ntokens);
+    return true;
+}
+
+// Returns the precompiled header's remaining tokens followed by tokens
+Token *pch_prepend(Token *tokens)
+{
+    if (!pch_first)
+        return tokens;
+    pch_last->next = tokens;
+    return pch_first;
+}
+
+// Adopts the image of a built-in header that is being included and returns
+// the header's tokens, already expanded, in an array of *count. Returns
+// NULL, having changed nothing, if the image does not hold here and the
+// text has to be preprocessed instead.
+//
+// The image was made by including the header on its own, so it covers the
+// headers that one includes as well. It holds if each file it covers is
+// either unread, or was read before and is guarded, so that including it
+// again would be skipped; that file's part of the image is left out. It
+// also holds only if each lookup recorded for a file still to be read
+// finds what it found then: no macro, or the same definition when that
+// came from a skipped file. A definition made by a file still to be read
+// is made again on the way, by replaying its #define and #undef lines.
+Token *pch_include(IncludeFile *inc, int *count)
+{
+    const PchHeader *h = pch_header(inc->image, inc->image_len);
+    if (!h)
+    {
+        TRACE(TRACE_PP, 1, "the image of %s is damaged", inc->path);
+        return NULL;
+    }
+    uint32_t nfiles = h->sections[PCH_FILES].count;
+    const PchFile *files = PCH_SECTION(PCH_FILES, PchFile);
+    // The files to read, by record plus one; the rest are skipped
+    IncludeFile **reads = calloc(nfiles + 1, sizeof(IncludeFile *));
+    bool ok = true;
+    for (uint32_t i = 0; ok && i < nfiles; i++)
+    {
+        // Each header still has to be the built-in one it was
+        const char *name = PCH_STR(files[i].name);
+        const char *path = intern(name, strlen(name));
+        const char *base = strrchr(name, '/');
+        IncludeFile *f = path == inc->path ? inc : base ? include_find(base + 1, true, NULL) : NULL;
+        const char *text = PCH_STR(files[i].text);
+        if (!f || f->path != path || !text || strlen(text) != f->text.len)
+            ok = false;
+        else if (f->file_id < 0)
+            reads[i + 1] = f;
+        else
+            ok = f != inc && (f->once || (f->guard && macro_lookup(f->guard)));
+    }
+#define PCH_SKIPPED(file) ((file) && !reads[file])
+    const PchMacro *defines = PCH_SECTION(PCH_DEFINES, PchMacro);
+    const PchLookup *lookups = PCH_SECTION(PCH_LOOKUPS, PchLookup);
+    for (uint32_t i = 0; ok && i < h->sections[PCH_LOOKUPS].count; i++)
+    {
+        const PchLookup *l = &lookups[i];
+        if (PCH_SKIPPED(l->file))
+            continue;
+        const char *name = PCH_STR(l->name);
+        const char *atom = intern_find(name, strlen(name));
+        MacroDef *m = atom ? macro_lookup(atom) : NULL;
+        const PchMacro *d = l->define ? &defines[l->define - 1] : NULL;
+        if (!d)
+            ok = !m;
+        else if (PCH_SKIPPED(d->file))
+            ok = m && pch_same_macro(h, d, m);
+    }
+    if (!ok)
+    {
+        TRACE(TRACE_PP, 1, "preprocessing %s, as its image does not hold here", inc->path);
+        free(reads);
+        return NULL;
+    }
+
+    int *file_ids = calloc(nfiles + 1, sizeof(int));
+    const char **texts = calloc(nfiles + 1, sizeof(char *));
+    file_ids[0] = source_file_add("<precompiled>", NULL);
+    for (uint32_t i = 1; i <= nfiles; i++)
+    {
+        IncludeFile *f = reads[i];
+        if (!f)
+        {
+            file_ids[i] = -1;
+            continue;
+        }
+        f->entered = true;
+        f->file_id = source_file_add(f->path, f->text.data);
+        file_ids[i] = f->file_id;
+        texts[i] = f->text.data;
+    }
+    for (uint32_t i = 0; i < h->sections[PCH_DEFINES].count; i++)
+        if (!PCH_SKIPPED(defines[i].file))
+            pch_adopt_macro(h, &defines[i], file_ids, texts);
+#undef PCH_SKIPPED
+    uint32_t ntokens;
+    Token *tokens = pch_adopt(h, pch_types(h), file_ids, texts, &ntokens);
+    free(reads);
+    free(file_ids);
+    free(texts);
+    TRACE(TRACE_PP, 1, "read %s from its image: %u tokens", inc->path, ntokens);
+    *count = ntokens;
+    return tokens;
+}
+#undef PCH_SECTION
+#undef PCH_STR
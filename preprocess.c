@@ -6,69 +6,197 @@
 #include <ctype.h>
 
 // Add at the very top of the file
-__attribute__((constructor)) static void file_loaded_notice() { fprintf(stderr, "[DEBUG] preprocess.c loaded\n"); }
+__attribute__((constructor)) static void file_loaded_notice() { TRACE(TRACE_PP, 2, "preprocess.c loaded"); }
 
-// Macro table and related structures (move from tokenize.c)
-typedef struct MacroDef
+// Macro table, keyed by interned name. A name keeps its slot once entered;
+// #undef only clears the definition.
+
+typedef struct
 {
-  struct MacroDef *next;
-  char *name;
-  char *value;
-  int is_function;
-  char **params;
-  int param_count;
-} MacroDef;
+  const char *name; // Interned
+  MacroDef *def;
+} MacroSlot;
+
+static PtrTable macros = PTR_TABLE(MacroSlot);
 
-static MacroDef *macro_table = NULL;
+MacroWatch *macro_watch;
 
-static void add_macro(const char *name, const char *value, int is_function, char **params, int param_count)
+static char *my_strndup(const char *s, size_t len)
 {
-  MacroDef *m = malloc(sizeof(MacroDef));
-  m->name = strdup(name);
-  m->value = strdup(value);
-  m->is_function = is_function;
+  char *copy = malloc(len + 1);
+  memcpy(copy, s, len);
+  copy[len] = 0;
+  return copy;
+}
+
+// Returns the entry for an interned name, defined or not, or NULL
+static MacroDef *macro_get(const char *atom)
+{
+  MacroSlot *slot = ptr_table_find(&macros, atom);
+  return slot ? slot->def : NULL;
+}
+
+static void clear_macro(MacroDef *m)
+{
+  if (!m->borrowed)
+    free(m->value);
+  free(m->params);
+  free(m->body);
+  m->value = NULL;
   m->params = NULL;
+  m->src = NULL;
+  m->body = NULL;
+  m->body_len = 0;
+  m->borrowed = false;
+  m->defined = false;
+}
+
+// Returns the cleared entry for an interned name, adding it if needed
+static MacroDef *macro_entry(const char *atom)
+{
+  bool added;
+  MacroSlot *slot = ptr_table_put(&macros, atom, &added);
+  if (added)
+  {
+    slot->def = calloc(1, sizeof(MacroDef));
+    slot->def->name = atom;
+  }
+  clear_macro(slot->def);
+  return slot->def;
+}
+
+// Defines name as value, taking ownership of params (interned names)
+static MacroDef *add_macro(const char *name, size_t namelen, const char *value, size_t vallen,
+                      int is_function, const char **params, int param_count)
+{
+  MacroDef *m = macro_entry(intern(name, namelen));
+  m->defined = true;
+  m->value = my_strndup(value, vallen);
+  m->is_function = is_function;
+  m->params = params;
+  m->param_count = param_count;
+  return m;
+}
+
+// Defines an interned name as a NUL-terminated value that stays owned by the
+// caller, as for macros mapped from a precompiled header. Takes ownership of
+// params. src is the value's place in the defining file, if known. A NULL
+// value undefines the name instead.
+void macro_adopt(const char *atom, const char *value, bool is_function,
+                 const char **params, int param_count, const char *src, int src_file)
+{
+  MacroDef *m = macro_entry(atom);
+  if (!value)
+    return;
+  m->defined = true;
+  m->borrowed = true;
+  m->value = (char *)value;
+  m->is_function = is_function;
+  m->params = params;
   m->param_count = param_count;
-  if (is_function && param_count > 0 && params)
+  m->src = src;
+  m->src_file = src_file;
+}
+
+// Calls visit for every defined macro
+void macro_foreach(MacroVisitor *visit, void *ctx)
+{
+  MacroSlot *slots = macros.slots;
+  for (uint32_t i = 0; i < macros.cap; i++)
   {
-    m->params = malloc(sizeof(char *) * param_count);
-    for (int i = 0; i < param_count; i++)
-      m->params[i] = strdup(params[i]);
+    MacroDef *m = slots[i].def;
+    if (m && m->defined)
+      visit(ctx, m->name, m->value, m->is_function, m->params, m->param_count);
   }
-  m->next = macro_table;
-  macro_table = m;
 }
 
-static void undef_macro(const char *name)
+static void undef_macro(const char *name, size_t namelen)
 {
-  MacroDef **p = &macro_table;
-  while (*p)
+  const char *atom = macro_watch ? intern(name, namelen) : intern_find(name, namelen);
+  MacroDef *m = atom ? macro_get(atom) : NULL;
+  if (m)
+    clear_macro(m);
+  if (macro_watch)
+    macro_watch(atom, NULL, true);
+}
+
+// Returns the definition of an interned name, or NULL
+MacroDef *macro_lookup(const char *atom)
+{
+  MacroDef *m = macro_get(atom);
+  if (m && !m->defined)
+    m = NULL;
+  if (macro_watch)
+    macro_watch(atom, m, false);
+  return m;
+}
+
+// Macro names are interned: a name that was never interned cannot be a
+// macro, and otherwise the probe compares pointers. A watcher sees every
+// name, so they are interned for it.
+static MacroDef *find_macro(const char *name, int len)
+{
+  const char *atom = macro_watch ? intern(name, len) : intern_find(name, len);
+  return atom ? macro_lookup(atom) : NULL;
+}
+
+static bool macro_defined(const char *atom)
+{
+  return macro_lookup(atom) != NULL;
+}
+
+// Growable text buffer. One with a sink is drained to it between lines
+// once it holds PP_FLUSH_SIZE bytes, so it stays about that size.
+typedef struct
+{
+  char *data;
+  size_t len;
+  size_t cap;
+  FILE *sink;
+  char last; // Last byte drained to sink
+} StrBuf;
+
+#define PP_FLUSH_SIZE (1024 * 1024)
+#define PP_CHUNK_SIZE (1024 * 1024)
+
+// Makes room for n more bytes plus a NUL, doubling the capacity
+static void buf_reserve(StrBuf *b, size_t n)
+{
+  if (b->len + n + 1 <= b->cap)
+    return;
+  while (b->len + n + 1 > b->cap)
+    b->cap = b->cap ? b->cap * 2 : 256;
+  b->data = realloc(b->data, b->cap);
+  if (!b->data)
   {
-    if (strcmp((*p)->name, name) == 0)
-    {
-      MacroDef *t = *p;
-      *p = t->next;
-      free(t->name);
-      free(t->value);
-      if (t->is_function)
-      {
-        for (int i = 0; i < t->param_count; i++)
-          free(t->params[i]);
-        free(t->params);
-      }
-      free(t);
-      return;
-    }
-    p = &(*p)->next;
+    fprintf(stderr, "[preprocess] Out of memory\n");
+    exit(1);
   }
 }
 
-static const char *find_macro(const char *name)
+static void buf_append(StrBuf *b, const char *s, size_t n)
 {
-  for (MacroDef *m = macro_table; m; m = m->next)
-    if (strcmp(m->name, name) == 0 && !m->is_function)
-      return m->value;
-  return NULL;
+  buf_reserve(b, n);
+  memcpy(b->data + b->len, s, n);
+  b->len += n;
+  b->data[b->len] = 0;
+}
+
+// Returns the last byte written to b, or 0 if there is none
+static char buf_last(StrBuf *b)
+{
+  return b->len ? b->data[b->len - 1] : b->last;
+}
+
+// Drains b to its sink when it has filled up
+static void buf_flush(StrBuf *b, bool force)
+{
+  if (!b->sink || !b->len || (!force && b->len < PP_FLUSH_SIZE))
+    return;
+  fwrite(b->data, 1, b->len, b->sink);
+  b->last = b->data[b->len - 1];
+  b->len = 0;
+  b->data[0] = 0;
 }
 
 // Helper: skip whitespace
@@ -79,533 +207,526 @@ static const char *skip_ws(const char *p)
   return p;
 }
 
-// Helper: copy and expand macros in a line
-static void expand_macros(const char *line, char *out, size_t *outpos)
+static bool is_ident_start(char c)
 {
-  const char *p = line;
-  while (*p)
+  return isalpha((unsigned char)c) || c == '_';
+}
+
+static bool is_ident_char(char c)
+{
+  return isalnum((unsigned char)c) || c == '_';
+}
+
+// Returns the end of the string or char literal starting at p
+static const char *skip_literal(const char *p, const char *end)
+{
+  char quote = *p++;
+  while (p < end && *p != quote)
+    p += (*p == '\\' && p + 1 < end) ? 2 : 1;
+  return p < end ? p + 1 : end;
+}
+
+// Trims blanks from both ends of s[0..*len)
+static const char *trim(const char *s, size_t *len)
+{
+  while (*len > 0 && isspace((unsigned char)*s))
   {
-    if (isalpha(*p) || *p == '_')
+    s++;
+    (*len)--;
+  }
+  while (*len > 0 && isspace((unsigned char)s[*len - 1]))
+    (*len)--;
+  return s;
+}
+
+// One argument of a macro call: a span of the source text
+typedef struct
+{
+  const char *text;
+  size_t len;
+} MacroArg;
+
+// Splits the argument list after the '(' at p, up to the matching ')', into
+// *args, which the caller frees. Returns the byte after ')' or NULL when the
+// list does not close before end.
+static const char *parse_macro_args(const char *p, const char *end,
+                                    MacroArg **args, int *argc)
+{
+  const char *arg_start = p;
+  int depth = 1, cap = 0;
+  *args = NULL;
+  *argc = 0;
+  while (p < end)
+  {
+    if (*p == '"' || *p == '\'')
     {
-      const char *start = p;
-      while (isalnum(*p) || *p == '_')
-        p++;
-      size_t len = p - start;
-      char name[128];
-      if (len < sizeof(name))
+      p = skip_literal(p, end);
+      continue;
+    }
+    if (*p == '(')
+      depth++;
+    else if (*p == ')')
+      depth--;
+    if ((depth == 1 && *p == ',') || depth == 0)
+    {
+      if (*argc == cap)
       {
-        strncpy(name, start, len);
-        name[len] = 0;
-        const char *val = find_macro(name);
-        if (val)
+        cap = cap ? cap * 2 : 8;
+        *args = realloc(*args, sizeof(MacroArg) * cap);
+        if (!*args)
         {
-          size_t vlen = strlen(val);
-          memcpy(out + *outpos, val, vlen);
-          *outpos += vlen;
-          continue;
+          fprintf(stderr, "[preprocess] Out of memory\n");
+          exit(1);
         }
       }
-      memcpy(out + *outpos, start, len);
-      *outpos += len;
+      (*args)[*argc].text = arg_start;
+      (*args)[*argc].len = p - arg_start;
+      (*argc)++;
+      arg_start = p + 1;
+      if (depth == 0)
+        return p + 1;
+    }
+    p++;
+  }
+  return NULL;
+}
+
+static void expand_text(const char *src, size_t len, StrBuf *out);
+
+// Substitutes the expanded arguments into m's body and expands the result
+static void expand_call(MacroDef *m, const MacroArg *args, int argc, StrBuf *out)
+{
+  StrBuf body = {0};
+  const char *q = m->value, *end = q + strlen(q);
+  while (q < end)
+  {
+    if (*q == '"' || *q == '\'')
+    {
+      const char *lit = q;
+      q = skip_literal(q, end);
+      buf_append(&body, lit, q - lit);
       continue;
     }
-    out[(*outpos)++] = *p++;
+    if (!is_ident_start(*q))
+    {
+      buf_append(&body, q++, 1);
+      continue;
+    }
+    const char *start = q;
+    while (is_ident_char(*q))
+      q++;
+    const char *atom = intern_find(start, q - start);
+    int i = 0;
+    while (atom && i < m->param_count && m->params[i] != atom)
+      i++;
+    if (!atom || i == m->param_count)
+    {
+      buf_append(&body, start, q - start);
+    }
+    else if (i < argc)
+    {
+      // Arguments are expanded fully before they are substituted
+      size_t alen = args[i].len;
+      const char *a = trim(args[i].text, &alen);
+      expand_text(a, alen, &body);
+    }
   }
+  m->expanding = true;
+  expand_text(body.data ? body.data : "", body.len, out);
+  m->expanding = false;
+  free(body.data);
 }
 
-// Helper: expand function-like macros in a line
-static int expand_function_macro(const char *line, char *out, size_t *outpos)
+// Marks a name that was left alone because its macro was being expanded.
+// Such a name must stay unexpanded when the text around it is rescanned, as
+// a macro argument or a macro's result is, so it carries this byte until
+// the line is written out.
+#define PP_PAINT "\x01"
+static bool painted; // Whether the line being expanded holds PP_PAINT
+
+// Appends src[0..len) to out with macros expanded, in one left-to-right
+// scan that looks up each identifier once. Literals and numbers are copied
+// as they are. A macro's expansion is rescanned with that macro disabled,
+// so self-referencing macros stop instead of recursing.
+static void expand_text(const char *src, size_t len, StrBuf *out)
 {
-  for (MacroDef *m = macro_table; m; m = m->next)
+  const char *p = src, *end = src + len;
+  while (p < end)
   {
-    if (!m->is_function || m->param_count < 1)
+    const char *start = p;
+    if (*p == *PP_PAINT)
+    {
+      p++;
+      while (p < end && is_ident_char(*p))
+        p++;
+      buf_append(out, start, p - start);
       continue;
-    const char *p = line;
-    while (*p)
+    }
+    if (*p == '"' || *p == '\'')
+    {
+      p = skip_literal(p, end);
+      buf_append(out, start, p - start);
+      continue;
+    }
+    if (isdigit((unsigned char)*p))
+    {
+      while (p < end && (is_ident_char(*p) || *p == '.'))
+        p++;
+      buf_append(out, start, p - start);
+      continue;
+    }
+    if (!is_ident_start(*p))
     {
-      // Look for macro name followed by '('
-      if ((p == line || !isalnum(*(p - 1))) && strncmp(p, m->name, strlen(m->name)) == 0 && p[strlen(m->name)] == '(')
+      buf_append(out, p++, 1);
+      continue;
+    }
+    while (p < end && is_ident_char(*p))
+      p++;
+    MacroDef *m = find_macro(start, p - start);
+    if (!m || m->expanding)
+    {
+      if (m)
       {
-        // Copy everything before macro name
-        size_t prefix_len = p - line;
-        memcpy(out + *outpos, line, prefix_len);
-        *outpos += prefix_len;
-        p += strlen(m->name); // move past macro name
-        if (*p != '(')
-          break;
-        p++; // skip '('
-        // Parse argument list (handle nested parens)
-        const char *args[32] = {0};
-        int arg_lens[32] = {0};
-        int argc = 0;
-        const char *arg_start = p;
-        int depth = 1;
-        while (*p && depth > 0)
-        {
-          if (*p == '(')
-            depth++;
-          else if (*p == ')')
-            depth--;
-          if ((depth == 1 && *p == ',' && argc < 32) || (depth == 0 && argc < 32))
-          {
-            int len = p - arg_start;
-            args[argc] = arg_start;
-            arg_lens[argc] = len;
-            argc++;
-            arg_start = p + 1;
-          }
-          p++;
-        }
-        // Now p points just after the closing ')'
-        // Expand macro body with arguments
-        char expanded[1024];
-        const char *val = m->value;
-        size_t epos = 0;
-        for (const char *q = val; *q;)
-        {
-          int matched = 0;
-          for (int i = 0; i < m->param_count; i++)
-          {
-            size_t plen = strlen(m->params[i]);
-            if (strncmp(q, m->params[i], plen) == 0 && !isalnum(q[plen]))
-            {
-              if (i < argc && args[i])
-              {
-                // Trim whitespace from argument
-                const char *a = args[i];
-                int alen = arg_lens[i];
-                while (alen > 0 && isspace(*a))
-                {
-                  a++;
-                  alen--;
-                }
-                while (alen > 0 && isspace(a[alen - 1]))
-                  alen--;
-                memcpy(expanded + epos, a, alen);
-                epos += alen;
-              }
-              q += plen;
-              matched = 1;
-              break;
-            }
-          }
-          if (!matched)
-            expanded[epos++] = *q++;
-        }
-        expanded[epos] = 0;
-        // Recursively expand the expanded macro body
-        char recursive[1024];
-        size_t recpos = 0;
-        expand_function_macro(expanded, recursive, &recpos);
-        recursive[recpos] = 0;
-        memcpy(out + *outpos, recursive, recpos);
-        *outpos += recpos;
-        // Recursively expand the rest of the line after the macro call
-        expand_function_macro(p, out, outpos);
-        return 1; // Expanded
+        buf_append(out, PP_PAINT, 1);
+        painted = true;
       }
-      p++;
+      buf_append(out, start, p - start);
+      continue;
+    }
+    if (!m->is_function)
+    {
+      m->expanding = true;
+      expand_text(m->value, strlen(m->value), out);
+      m->expanding = false;
+      continue;
     }
+    // A function-like macro name is only a call when '(' follows
+    const char *q = p;
+    while (q < end && (*q == ' ' || *q == '\t'))
+      q++;
+    MacroArg *args = NULL;
+    int argc;
+    const char *after = (q < end && *q == '(') ? parse_macro_args(q + 1, end, &args, &argc) : NULL;
+    if (after)
+      expand_call(m, args, argc, out);
+    free(args);
+    if (!after)
+    {
+      buf_append(out, start, p - start);
+      continue;
+    }
+    p = after;
   }
-  // If no macro expanded, copy the line as is
-  size_t len = strlen(line);
-  memcpy(out + *outpos, line, len);
-  *outpos += len;
-  out[*outpos] = 0;
-  return 0;
 }
 
-#define MAX_COND_DEPTH 32
+// Expands a line of source onto the end of out
+static void expand_line(const char *line, size_t len, StrBuf *out)
+{
+  size_t mark = out->len;
+  painted = false;
+  expand_text(line, len, out);
+  if (!painted)
+    return;
+  char *w = memchr(out->data + mark, *PP_PAINT, out->len - mark);
+  for (const char *r = w; r < out->data + out->len; r++)
+    if (*r != *PP_PAINT)
+      *w++ = *r;
+  out->len = w - out->data;
+  out->data[out->len] = 0;
+}
 
-static char *read_file(const char *filename)
+// Returns the end of the line at p: its '\n' or '\r', or the final NUL
+const char *line_end_of(const char *p)
 {
-  FILE *f = fopen(filename, "rb");
-  if (!f)
-    return NULL;
-  fseek(f, 0, SEEK_END);
-  long fsize = ftell(f);
-  fseek(f, 0, SEEK_SET);
-  char *buf = malloc(fsize + 1);
-  if (!buf)
+  while (*p && *p != '\n' && *p != '\r')
+    p++;
+  return p;
+}
+
+// Returns the first directive line in [p, end), where p starts a line, or
+// end if there is none. Only the '#' bytes are looked at, found by memchr,
+// so the lines of an inactive region are passed over without being read.
+const char *next_directive(const char *p, const char *end)
+{
+  const char *start = p;
+  for (const char *hash; (hash = memchr(p, '#', end - p)); p = hash + 1)
   {
-    fclose(f);
-    return NULL;
+    const char *q = hash;
+    while (q > start && (q[-1] == ' ' || q[-1] == '\t'))
+      q--;
+    if (q == start || q[-1] == '\n' || q[-1] == '\r')
+      return q;
   }
-  fread(buf, 1, fsize, f);
-  buf[fsize] = 0;
-  fclose(f);
-  return buf;
+  return end;
 }
 
 static void print_macro_table(void)
 {
-  fprintf(stderr, "[MACRO TABLE]\n");
-  for (MacroDef *m = macro_table; m; m = m->next)
+  if (!TRACE_ON(TRACE_PP, 2))
+    return;
+  trace_print(TRACE_PP, "macro table:");
+  MacroSlot *slots = macros.slots;
+  for (uint32_t slot = 0; slot < macros.cap; slot++)
   {
-    fprintf(stderr, "  name='%s' is_function=%d param_count=%d value='%s'\n", m->name, m->is_function, m->param_count, m->value);
+    MacroDef *m = slots[slot].def;
+    if (!m || !m->defined)
+      continue;
+    trace_print(TRACE_PP, "  name='%s' is_function=%d param_count=%d value='%s'", m->name, m->is_function, m->param_count, m->value);
     if (m->is_function && m->param_count > 0)
     {
-      fprintf(stderr, "    params:");
-      for (int i = 0; i < m->param_count; i++)
-        fprintf(stderr, " '%s'", m->params[i]);
-      fprintf(stderr, "\n");
+      char params[512];
+      int len = 0;
+      for (int i = 0; i < m->param_count && len < (int)sizeof(params); i++)
+        len += snprintf(params + len, sizeof(params) - len, " '%s'", m->params[i]);
+      trace_print(TRACE_PP, "    params:%s", params);
     }
   }
-  fflush(stderr);
 }
 
-char *preprocess_input(const char *input_file, const char *input_buffer)
+// Matches the directive or keyword word at q, which must not run on into
+// an identifier
+static bool match_word(const char *q, const char *end, const char *word)
+{
+  size_t n = strlen(word);
+  return (size_t)(end - q) >= n && !memcmp(q, word, n) && (q + n == end || !is_ident_char(q[n]));
+}
+
+static const char *scan_name(const char *q, const char *end)
+{
+  while (q < end && is_ident_char(*q))
+    q++;
+  return q;
+}
+
+// Runs the directive on line, whose name starts at q, just past the '#'.
+// Returns the file an #include names when it should be read next, or NULL.
+// Inside an inactive region only the conditional directives have effect.
+IncludeFile *run_directive(PPFile *f, const char *line, const char *q, const char *line_end)
 {
-  fprintf(stderr, "[PREPROC DEBUG] Entered preprocess_input\n");
-  // Macro table is static, clear it first
-  while (macro_table)
+  int linelen = (int)(line_end - line);
+  q = skip_ws(q);
+  if (!f->is_active && !match_word(q, line_end, "ifdef") && !match_word(q, line_end, "ifndef") &&
+      !match_word(q, line_end, "else") && !match_word(q, line_end, "endif"))
+    return NULL;
+  if (match_word(q, line_end, "include"))
   {
-    MacroDef *next = macro_table->next;
-    free(macro_table->name);
-    free(macro_table->value);
-    if (macro_table->is_function)
+    TRACE(TRACE_PP, 2, "found #include");
+    q += 7;
+    q = skip_ws(q);
+    if (*q != '"' && *q != '<')
+    {
+      fprintf(stderr, "[preprocess] Malformed #include directive: %.*s\n", linelen, line);
+      return NULL;
+    }
+    char endch = (*q == '"') ? '"' : '>';
+    q++;
+    const char *fname_start = q;
+    while (q < line_end && *q != endch)
+      q++;
+    if (q >= line_end)
+    {
+      fprintf(stderr, "[preprocess] Malformed #include directive: %.*s\n", linelen, line);
+      return NULL;
+    }
+    char *filename = my_strndup(fname_start, q - fname_start);
+    IncludeFile *inc = include_find(filename, endch == '>', f->path);
+    if (!inc)
     {
-      for (int i = 0; i < macro_table->param_count; i++)
-        free(macro_table->params[i]);
-      free(macro_table->params);
+      fprintf(stderr, "[preprocess] Failed to open include file: %s\n", filename);
     }
-    free(macro_table);
-    macro_table = next;
+    else if (inc->entered && (inc->once || (inc->guard && macro_defined(inc->guard))))
+    {
+      TRACE(TRACE_PP, 2, "skipping %s, already included", filename);
+      inc = NULL;
+    }
+    else
+    {
+      inc->entered = true;
+    }
+    free(filename);
+    return inc;
   }
-  size_t inlen = strlen(input_buffer);
-  char *out = malloc(inlen * 2 + 1); // Output may be longer due to macro expansion
-  size_t outpos = 0;
-  const char *p = input_buffer;
-  int cond_stack[MAX_COND_DEPTH];
-  int cond_top = 0;
-  int is_active = 1;
-  while (*p)
+  if (match_word(q, line_end, "define"))
   {
-    const char *line_start = p;
-    // Find end of line
-    const char *line_end = p;
-    while (*line_end && *line_end != '\n' && *line_end != '\r')
-      line_end++;
-    size_t linelen = line_end - line_start;
-    // Copy line to temp buffer
-    char line[1024];
-    if (linelen >= sizeof(line))
-      linelen = sizeof(line) - 1;
-    strncpy(line, line_start, linelen);
-    line[linelen] = 0;
-    fprintf(stderr, "[PREPROC DEBUG] Processing line: %s\n", line);
-    // Check for preprocessor directive
-    const char *q = skip_ws(line);
-    if (*q == '#')
+    TRACE(TRACE_PP, 2, "found #define");
+    q += 6;
+    q = skip_ws(q);
+    // Parse macro name
+    const char *name_start = q;
+    q = scan_name(q, line_end);
+    size_t namelen = q - name_start;
+    if (namelen == 0)
+    {
+      fprintf(stderr, "[preprocess] Malformed #define directive: %.*s\n", linelen, line);
+      return NULL;
+    }
+    const char **params = NULL;
+    int param_count = 0;
+    int is_function = *q == '(';
+    if (is_function)
     {
       q++;
       q = skip_ws(q);
-      if (strncmp(q, "include", 7) == 0 && isspace(q[7]))
+      // Parse parameter list
+      while (q < line_end && *q != ')')
       {
-        fprintf(stderr, "[PREPROC DEBUG] Found #include\n");
-        q += 7;
-        q = skip_ws(q);
-        if (*q == '"' || *q == '<')
-        {
-          char endch = (*q == '"') ? '"' : '>';
+        const char *param_start = q;
+        while (q < line_end && *q != ',' && *q != ')')
           q++;
-          const char *fname_start = q;
-          while (*q && *q != endch)
-            q++;
-          size_t fnamelen = q - fname_start;
-          if (*q == endch)
-          {
-            char filename[256];
-            if (fnamelen >= sizeof(filename))
-              fnamelen = sizeof(filename) - 1;
-            strncpy(filename, fname_start, fnamelen);
-            filename[fnamelen] = 0;
-            char *filebuf = read_file(filename);
-            if (!filebuf)
-            {
-              fprintf(stderr, "[preprocess] Failed to open include file: %s\n", filename);
-            }
-            else
-            {
-              char *included = preprocess_input(filename, filebuf);
-              size_t out_len = strlen(included);
-              memcpy(out + outpos, included, out_len);
-              outpos += out_len;
-              free(filebuf);
-              free(included);
-            }
-          }
-          else
-          {
-            fprintf(stderr, "[preprocess] Malformed #include directive: %s\n", line);
-          }
-        }
-        else
-        {
-          fprintf(stderr, "[preprocess] Malformed #include directive: %s\n", line);
-        }
-        goto next_line;
-      }
-      if (strncmp(q, "define", 6) == 0 && isspace(q[6]))
-      {
-        fprintf(stderr, "[PREPROC DEBUG] Found #define\n");
-        q += 6;
-        q = skip_ws(q);
-        // Parse macro name
-        const char *name_start = q;
-        while (*q && (isalnum(*q) || *q == '_'))
-          q++;
-        size_t namelen = q - name_start;
-        if (namelen == 0)
-        {
-          fprintf(stderr, "[preprocess] Malformed #define directive: %s\n", line);
-          goto next_line;
-        }
-        char macro_name[128];
-        if (namelen >= sizeof(macro_name))
-          namelen = sizeof(macro_name) - 1;
-        strncpy(macro_name, name_start, namelen);
-        macro_name[namelen] = 0;
-        q = skip_ws(q);
-        // Check if next char is '('
-        if (*q == '(')
+        size_t param_len = q - param_start;
+        if (*q == ',')
         {
           q++;
           q = skip_ws(q);
-          // Parse parameter list
-          char **params = NULL;
-          int param_count = 0;
-          while (*q && *q != ')')
-          {
-            const char *param_start = q;
-            while (*q && *q != ',' && *q != ')')
-              q++;
-            size_t param_len = q - param_start;
-            if (*q == ',')
-            {
-              q++;
-              q = skip_ws(q);
-            }
-            if (param_len > 0)
-            {
-              // Trim whitespace from parameter name
-              while (param_len > 0 && isspace(*param_start))
-              {
-                param_start++;
-                param_len--;
-              }
-              while (param_len > 0 && isspace(param_start[param_len - 1]))
-                param_len--;
-              params = realloc(params, sizeof(char *) * (param_count + 1));
-              params[param_count] = malloc(param_len + 1);
-              strncpy(params[param_count], param_start, param_len);
-              params[param_count][param_len] = 0;
-              param_count++;
-            }
-          }
-          if (*q == ')')
-            q++;
-          // Skip whitespace after ')'
-          q = skip_ws(q);
-          // Parse macro value (rest of line)
-          char macro_val[512];
-          size_t vallen = 0;
-          if (*q)
-          {
-            const char *val_start = q;
-            while (*q)
-              q++;
-            vallen = q - val_start;
-            if (vallen >= sizeof(macro_val))
-              vallen = sizeof(macro_val) - 1;
-            strncpy(macro_val, val_start, vallen);
-            macro_val[vallen] = 0;
-          }
-          else
-          {
-            macro_val[0] = 0;
-          }
-          fprintf(stderr, "[DEBUG] add_macro: name='%s' value='%s' is_function=%d\n", macro_name, macro_val, 1);
-          fflush(stderr);
-          add_macro(macro_name, macro_val, 1, params, param_count);
-          print_macro_table();
-          goto next_line;
-        }
-        else
-        {
-          // Parse macro value (rest of line)
-          char macro_val[512];
-          size_t vallen = 0;
-          if (*q)
-          {
-            const char *val_start = q;
-            while (*q)
-              q++;
-            vallen = q - val_start;
-            if (vallen >= sizeof(macro_val))
-              vallen = sizeof(macro_val) - 1;
-            strncpy(macro_val, val_start, vallen);
-            macro_val[vallen] = 0;
-          }
-          else
-          {
-            macro_val[0] = 0;
-          }
-          fprintf(stderr, "[DEBUG] add_macro: name='%s' value='%s' is_function=%d\n", macro_name, macro_val, 0);
-          fflush(stderr);
-          add_macro(macro_name, macro_val, 0, NULL, 0);
-          print_macro_table();
-          goto next_line;
-        }
-      }
-      if (strncmp(q, "undef", 5) == 0 && isspace(q[5]))
-      {
-        fprintf(stderr, "[PREPROC DEBUG] Found #undef\n");
-        q += 5;
-        q = skip_ws(q);
-        const char *name_start = q;
-        while (*q && (isalnum(*q) || *q == '_'))
-          q++;
-        size_t namelen = q - name_start;
-        if (namelen == 0)
-        {
-          fprintf(stderr, "[preprocess] Malformed #undef directive: %s\n", line);
-          goto next_line;
         }
-        char macro_name[128];
-        if (namelen >= sizeof(macro_name))
-          namelen = sizeof(macro_name) - 1;
-        strncpy(macro_name, name_start, namelen);
-        macro_name[namelen] = 0;
-        undef_macro(macro_name);
-        goto next_line;
-      }
-      if (strncmp(q, "ifdef", 5) == 0 && isspace(q[5]))
-      {
-        fprintf(stderr, "[PREPROC DEBUG] Found #ifdef\n");
-        q += 5;
-        q = skip_ws(q);
-        const char *name_start = q;
-        while (*q && (isalnum(*q) || *q == '_'))
-          q++;
-        size_t namelen = q - name_start;
-        char macro_name[128] = {0};
-        if (namelen > 0 && namelen < sizeof(macro_name))
+        // Trim whitespace from parameter name
+        param_start = trim(param_start, &param_len);
+        if (param_len > 0)
         {
-          strncpy(macro_name, name_start, namelen);
-          macro_name[namelen] = 0;
+          params = realloc(params, sizeof(char *) * (param_count + 1));
+          params[param_count++] = intern(param_start, param_len);
         }
-        int cond = (namelen > 0) ? (find_macro(macro_name) != NULL) : 0;
-        if (cond_top < MAX_COND_DEPTH)
-          cond_stack[cond_top++] = is_active;
-        is_active = is_active && cond;
-        goto next_line;
       }
-      if (strncmp(q, "ifndef", 6) == 0 && isspace(q[6]))
-      {
-        fprintf(stderr, "[PREPROC DEBUG] Found #ifndef\n");
-        q += 6;
-        q = skip_ws(q);
-        const char *name_start = q;
-        while (*q && (isalnum(*q) || *q == '_'))
-          q++;
-        size_t namelen = q - name_start;
-        char macro_name[128] = {0};
-        if (namelen > 0 && namelen < sizeof(macro_name))
-        {
-          strncpy(macro_name, name_start, namelen);
-          macro_name[namelen] = 0;
-        }
-        int cond = (namelen > 0) ? (find_macro(macro_name) != NULL) : 0;
-        if (cond_top < MAX_COND_DEPTH)
-          cond_stack[cond_top++] = is_active;
-        is_active = is_active && !cond;
-        goto next_line;
-      }
-      if (strncmp(q, "else", 4) == 0 && isspace(q[4]))
-      {
-        fprintf(stderr, "[PREPROC DEBUG] Found #else\n");
-        if (cond_top > 0)
-        {
-          int prev = cond_stack[cond_top - 1];
-          is_active = prev && !is_active;
-        }
-        else
-        {
-          fprintf(stderr, "[preprocess] Unmatched #else directive: %s\n", line);
-        }
-        goto next_line;
-      }
-      if (strncmp(q, "endif", 5) == 0 && isspace(q[5]))
+      if (*q == ')')
+        q++;
+    }
+    // Macro value is the rest of the line
+    q = skip_ws(q);
+    TRACE(TRACE_PP, 2, "add_macro: name='%.*s' value='%.*s' is_function=%d",
+          (int)namelen, name_start, (int)(line_end - q), q, is_function);
+    MacroDef *m = add_macro(name_start, namelen, q, line_end - q, is_function, params, param_count);
+    if (f->file_id >= 0)
+    {
+      m->src = q;
+      m->src_file = f->file_id;
+    }
+    if (macro_watch)
+      macro_watch(m->name, m, true);
+    print_macro_table();
+    return NULL;
+  }
+  if (match_word(q, line_end, "undef"))
+  {
+    TRACE(TRACE_PP, 2, "found #undef");
+    q += 5;
+    q = skip_ws(q);
+    const char *name_start = q;
+    q = scan_name(q, line_end);
+    if (q == name_start)
+    {
+      fprintf(stderr, "[preprocess] Malformed #undef directive: %.*s\n", linelen, line);
+      return NULL;
+    }
+    undef_macro(name_start, q - name_start);
+    return NULL;
+  }
+  if (match_word(q, line_end, "ifdef") || match_word(q, line_end, "ifndef"))
+  {
+    bool negate = q[2] == 'n';
+    TRACE(TRACE_PP, 2, negate ? "found #ifndef" : "found #ifdef");
+    q += negate ? 6 : 5;
+    q = skip_ws(q);
+    const char *name_start = q;
+    q = scan_name(q, line_end);
+    int cond = (q > name_start) ? (find_macro(name_start, q - name_start) != NULL) : 0;
+    if (f->cond_top < MAX_COND_DEPTH)
+      f->cond_stack[f->cond_top++] = f->is_active;
+    f->is_active = f->is_active && (negate ? !cond : cond);
+    return NULL;
+  }
+  if (match_word(q, line_end, "else"))
+  {
+    TRACE(TRACE_PP, 2, "found #else");
+    if (f->cond_top > 0)
+    {
+      int prev = f->cond_stack[f->cond_top - 1];
+      f->is_active = prev && !f->is_active;
+    }
+    else
+    {
+      fprintf(stderr, "[preprocess] Unmatched #else directive: %.*s\n", linelen, line);
+    }
+    return NULL;
+  }
+  if (match_word(q, line_end, "endif"))
+  {
+    TRACE(TRACE_PP, 2, "found #endif");
+    if (f->cond_top > 0)
+      f->is_active = f->cond_stack[--f->cond_top];
+    else
+      fprintf(stderr, "[preprocess] Unmatched #endif directive: %.*s\n", linelen, line);
+    return NULL;
+  }
+  if (match_word(q, line_end, "pragma"))
+  {
+    q = skip_ws(q + 6);
+    if (match_word(q, line_end, "once") && f->inc)
+      f->inc->once = true;
+    // Other pragmas are ignored
+    return NULL;
+  }
+  // Unknown or malformed directive: skip
+  fprintf(stderr, "[preprocess] Unknown or malformed directive: %.*s\n", linelen, line);
+  return NULL;
+}
+
+static void preprocess_into(IncludeFile *file, StrBuf *out);
+
+// Preprocesses the NUL-terminated lines from p to end as part of f,
+// appending the result to out. Lines are read in place from the input;
+// nothing is copied into fixed buffers.
+static void preprocess_lines(PPFile *f, const char *p, const char *end, StrBuf *out)
+{
+  while (*p)
+  {
+    // Only directives matter in an inactive region
+    if (!f->is_active && !*(p = next_directive(p, end)))
+      break;
+    const char *line = p;
+    const char *line_end = line_end_of(p);
+    int linelen = (int)(line_end - line);
+    TRACE(TRACE_PP, 2, "processing line: %.*s", linelen, line);
+    // Check for preprocessor directive
+    const char *q = skip_ws(line);
+    if (*q == '#')
+    {
+      IncludeFile *inc = run_directive(f, line, q + 1, line_end);
+      if (inc)
       {
-        fprintf(stderr, "[PREPROC DEBUG] Found #endif\n");
-        if (cond_top > 0)
-          is_active = cond_stack[--cond_top];
-        else
-          fprintf(stderr, "[preprocess] Unmatched #endif directive: %s\n", line);
-        goto next_line;
+        preprocess_into(inc, out);
+        // Keep the next line of this file on a line of its own
+        if (buf_last(out) && buf_last(out) != '\n')
+          buf_append(out, "\n", 1);
       }
-      // Unknown or malformed directive: skip
-      fprintf(stderr, "[preprocess] Unknown or malformed directive: %s\n", line);
-      goto next_line;
     }
     // Skip comment lines (// ...)
-    if (strncmp(q, "//", 2) == 0)
+    else if (strncmp(q, "//", 2) == 0)
     {
-      goto next_line;
     }
-    else if (is_active)
+    else if (f->is_active)
     {
-      // Only output the fully expanded version of the line, not the original
-      char expanded_line[2048];
-      char temp_line[2048];
-      size_t expanded_pos = 0;
-      size_t temp_pos = 0;
-      // Start with the original line
-      strncpy(temp_line, line, sizeof(temp_line) - 1);
-      temp_line[sizeof(temp_line) - 1] = 0;
-      int changed;
-      // Recursively expand function-like macros until no more changes
-      do
+      // Expand straight into the output, taking it back if the line comes
+      // out empty or blank
+      size_t mark = out->len;
+      expand_line(line, linelen, out);
+      TRACE(TRACE_PP, 2, "original: '%.*s' | expanded: '%.*s'", linelen, line,
+            (int)(out->len - mark), out->data + mark);
+      if (out->len == mark || !*skip_ws(out->data + mark))
       {
-        expanded_pos = 0;
-        changed = expand_function_macro(temp_line, expanded_line, &expanded_pos);
-        expanded_line[expanded_pos] = 0;
-        if (changed)
-        {
-          strncpy(temp_line, expanded_line, sizeof(temp_line) - 1);
-          temp_line[sizeof(temp_line) - 1] = 0;
-        }
-      } while (changed);
-      // Now expand object-like macros in the final result
-      expanded_pos = 0;
-      expand_macros(temp_line, expanded_line, &expanded_pos);
-      expanded_line[expanded_pos] = 0;
-      // Debug: print the original and expanded line
-      fprintf(stderr, "[PREPROC DEBUG] Original: '%s' | Expanded: '%s'\n", line, expanded_line);
-      // Only output if the line is not empty or whitespace
-      const char *outptr = skip_ws(expanded_line);
-      if (*outptr)
+        out->len = mark;
+        if (out->data)
+          out->data[mark] = 0;
+      }
+      // Add line ending
+      else if (*line_end == '\r' && *(line_end + 1) == '\n')
       {
-        memcpy(out + outpos, expanded_line, expanded_pos);
-        outpos += expanded_pos;
-        // Add line ending
-        if (*line_end == '\r' && *(line_end + 1) == '\n')
-        {
-          out[outpos++] = '\r';
-          out[outpos++] = '\n';
-        }
-        else if (*line_end == '\n' || *line_end == '\r')
-        {
-          out[outpos++] = *line_end;
-        }
+        buf_append(out, "\r\n", 2);
+      }
+      else if (*line_end == '\n' || *line_end == '\r')
+      {
+        buf_append(out, line_end, 1);
       }
     }
-    else
-    {
-      fprintf(stderr, "[PREPROC DEBUG] Skipping inactive line due to conditional\n");
-    }
-  next_line:
     // Move to next line
     if (*line_end == '\r' && *(line_end + 1) == '\n')
       p = line_end + 2;
@@ -613,7 +734,71 @@ char *preprocess_input(const char *input_file, const char *input_buffer)
       p = line_end + 1;
     else
       p = line_end;
+    buf_flush(out, false);
   }
-  out[outpos] = 0;
-  return out;
-}
\ No newline at end of file
+}
+
+// Preprocesses an included file's text, appending the result to out
+static void preprocess_into(IncludeFile *file, StrBuf *out)
+{
+  PPFile f = {.inc = file, .path = file->path, .file_id = -1, .is_active = 1};
+  preprocess_lines(&f, file->text.data, file->text.data + file->text.len, out);
+}
+
+// Preprocesses the stream in to out without holding either in memory.
+// The input is read in chunks cut after their last complete line, which the
+// line-at-a-time preprocessor cannot tell from one buffer; a line longer
+// than a chunk grows the buffer to fit. Output is written in blocks of about
+// PP_FLUSH_SIZE. Returns false on a read or write error.
+bool preprocess_stream(const char *input_file, FILE *in, FILE *out)
+{
+  TRACE(TRACE_PP, 1, "entered preprocess_stream for %s", input_file);
+  PPFile f = {.path = input_file, .file_id = -1, .is_active = 1};
+  StrBuf text = {.sink = out};
+  buf_reserve(&text, PP_FLUSH_SIZE);
+  size_t cap = PP_CHUNK_SIZE, len = 0;
+  char *chunk = malloc(cap + 1);
+  if (!chunk)
+  {
+    fprintf(stderr, "[preprocess] Out of memory\n");
+    exit(1);
+  }
+  for (;;)
+  {
+    if (len == cap)
+    {
+      cap *= 2;
+      chunk = realloc(chunk, cap + 1);
+      if (!chunk)
+      {
+        fprintf(stderr, "[preprocess] Out of memory\n");
+        exit(1);
+      }
+    }
+    size_t n = fread(chunk + len, 1, cap - len, in);
+    len += n;
+    bool eof = n == 0;
+    // Cut after the last newline, or take everything at the end of input
+    size_t cut = len;
+    if (!eof)
+    {
+      while (cut && chunk[cut - 1] != '\n')
+        cut--;
+      if (!cut)
+        continue;
+    }
+    char keep = chunk[cut];
+    chunk[cut] = 0;
+    preprocess_lines(&f, chunk, chunk + cut, &text);
+    chunk[cut] = keep;
+    memmove(chunk, chunk + cut, len - cut);
+    len -= cut;
+    if (eof)
+      break;
+  }
+  buf_flush(&text, true);
+  bool ok = !ferror(in) && fflush(out) == 0 && !ferror(out);
+  free(chunk);
+  free(text.data);
+  return ok;
+}
@@ -2,11 +2,73 @@
 #define PREPROCESS_H
 #include "lawsa.h"
 
-// Preprocess the token list (macro expansion, includes, conditionals)
-// Token *preprocess_tokens(Token *tokens, const char *input_file);
+// Preprocess input into a token stream for the parser (macro expansion,
+// includes, conditionals)
+Token *preprocess_tokens(const char *input_file, const char *input, bool eager);
 
-// Preprocess the raw input buffer (macros, includes, conditionals)
-// Returns a malloc'd buffer containing only valid C code (no preprocessor lines)
-char *preprocess_input(const char *input_file, const char *input_buffer);
+// Preprocess a stream, writing the output as it goes; memory use does not
+// grow with the size of either. Returns false on an I/O error.
+bool preprocess_stream(const char *input_file, FILE *in, FILE *out);
+
+// Macro table access for precompiled headers (pch.c)
+typedef void MacroVisitor(void *ctx, const char *name, const char *value, bool is_function,
+                          const char **params, int param_count);
+void macro_foreach(MacroVisitor *visit, void *ctx);
+void macro_adopt(const char *name, const char *value, bool is_function,
+                 const char **params, int param_count, const char *src, int src_file);
+
+// Shared by the text and token-level preprocessors (preprocess.c)
+#define MAX_COND_DEPTH 32
+
+// Macro table entry
+typedef struct MacroDef
+{
+  const char *name; // Interned
+  bool defined;
+  bool expanding; // Set while its expansion is rescanned
+  bool borrowed;  // value lives in a precompiled header image
+  char *value;
+  int is_function;
+  const char **params; // Interned parameter names
+  int param_count;
+  const char *src; // value's place in the defining file, for token positions
+  int src_file;    // Source file id of src
+  Token *body;     // value lexed on first token-level expansion
+  int body_len;
+} MacroDef;
+
+// A file being preprocessed, with its #ifdef nesting
+typedef struct PPFile
+{
+  struct PPFile *parent; // Includer, while preprocessing to tokens
+  IncludeFile *inc;      // Include cache entry, NULL for the main input
+  const char *path;      // Name of the file, to find its includes relative to
+  int file_id;           // Source file of its tokens, -1 when writing text
+  const char *p;         // Next unread byte, while preprocessing to tokens
+  const char *end;       // End of the text, while preprocessing to tokens
+  bool line_start;       // p is at the start of a line
+  LexAhead *ahead;       // Tokens of a large text, lexed on threads up front
+  Token *image;          // Tokens of a precompiled image, read in place of the text
+  int image_len;
+  int image_pos;         // Next unread one
+  int cond_stack[MAX_COND_DEPTH];
+  int cond_top;
+  int is_active;
+} PPFile;
+
+MacroDef *macro_lookup(const char *atom);
+IncludeFile *run_directive(PPFile *f, const char *line, const char *q, const char *line_end);
+const char *line_end_of(const char *p);
+const char *next_directive(const char *p, const char *end);
+
+// Set while a built-in header's image is made (pch.c). Called with every
+// name the preprocessor looks up as a macro, and with every #define and
+// #undef (defining set), along with the definition the name has, or NULL.
+typedef void MacroWatch(const char *atom, const MacroDef *m, bool defining);
+extern MacroWatch *macro_watch;
+
+// Source file of the innermost file being preprocessed to tokens, or -1
+// (preprocess_tokens.c)
+int pp_current_file(void);
 
 #endif // PREPROCESS_H
\ No newline at end of file
@@ -3,77 +3,50 @@
 #include <string.h>
 #include "preprocess.h"
 
-// Helper to read file into buffer
-static char *read_file(const char *filename)
-{
-  FILE *f = fopen(filename, "rb");
-  if (!f)
-    return NULL;
-  fseek(f, 0, SEEK_END);
-  long fsize = ftell(f);
-  fseek(f, 0, SEEK_SET);
-  char *buf = malloc(fsize + 1);
-  if (!buf)
-  {
-    fclose(f);
-    return NULL;
-  }
-  fread(buf, 1, fsize, f);
-  buf[fsize] = 0;
-  fclose(f);
-  return buf;
-}
-
+// Usage: preprocess [-E] [-I dir] [-isystem dir] [file]
+// Preprocesses file, or stdin if there is none, to stdout. The input is
+// read and the output written a chunk at a time, so the tool works as a
+// filter on sources of any size. -E is accepted for compiler-style command
+// lines; streaming is the only mode. -I and -isystem add directories to
+// search for included files.
 int main(int argc, char **argv)
 {
-  char *input = NULL;
   const char *input_file = NULL;
-  if (argc >= 2)
+  for (int i = 1; i < argc; i++)
   {
-    input_file = argv[1];
-    input = read_file(input_file);
-    if (!input)
+    if (strcmp(argv[i], "-E") == 0)
+      continue;
+    if (strcmp(argv[i], "-I") == 0 && i + 1 < argc)
+      include_add_dir(argv[++i], false);
+    else if (strncmp(argv[i], "-I", 2) == 0 && argv[i][2])
+      include_add_dir(argv[i] + 2, false);
+    else if (strcmp(argv[i], "-isystem") == 0 && i + 1 < argc)
+      include_add_dir(argv[++i], true);
+    else if (input_file || argv[i][0] == '-')
     {
-      fprintf(stderr, "[preprocess_main] Could not open input file: %s\n", input_file);
+      fprintf(stderr, "Usage: %s [-E] [-I dir] [-isystem dir] [file]\n", argv[0]);
       return 1;
     }
+    else
+      input_file = argv[i];
   }
-  else
+  FILE *in = stdin;
+  if (input_file)
   {
-    // Read from stdin
-    size_t cap = 4096, len = 0;
-    input = malloc(cap);
-    if (!input)
+    in = fopen(input_file, "rb");
+    if (!in)
     {
-      fprintf(stderr, "[preprocess_main] Out of memory\n");
+      fprintf(stderr, "[preprocess_main] Could not open input file: %s\n", input_file);
       return 1;
     }
-    int c;
-    while ((c = getchar()) != EOF)
-    {
-      if (len + 1 >= cap)
-      {
-        cap *= 2;
-        char *tmp = realloc(input, cap);
-        if (!tmp)
-        {
-          free(input);
-          fprintf(stderr, "[preprocess_main] Out of memory\n");
-          return 1;
-        }
-        input = tmp;
-      }
-      input[len++] = (char)c;
-    }
-    input[len] = 0;
-    input_file = "<stdin>";
   }
-  char *out = preprocess_input(input_file, input);
-  if (out)
+  bool ok = preprocess_stream(input_file ? input_file : "<stdin>", in, stdout);
+  if (in != stdin)
+    fclose(in);
+  if (!ok)
   {
-    printf("%s", out);
-    free(out);
+    fprintf(stderr, "[preprocess_main] I/O error\n");
+    return 1;
   }
-  free(input);
   return 0;
-}
\ No newline at end of file
+}
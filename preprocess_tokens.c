@@ -0,0 +1,446 @@
+// preprocess_tokens.c - Token-level preprocessing
+//
+// preprocess_tokens() feeds the parser straight from the source files. Each
+// file is lexed once, directives run as their lines come up, and macros are
+// expanded on the token stream. Every token carries a hide-set, the names of
+// the macros whose expansion produced it, and none of those macros expands
+// it again (Prosser's algorithm). Tokens from a macro body point into the
+// #define line, so positions stay accurate through includes and expansions.
+// The macro table and directives are shared with the text preprocessor
+// used by the standalone preprocess tool (preprocess.c). A built-in header
+// whose precompiled image holds is read from the image instead; its tokens
+// are already expanded, so they hide every macro (pch_include()).
+#include "preprocess.h"
+
+typedef struct Hideset
+{
+  struct Hideset *next;
+  const char *name; // Interned macro name
+} Hideset;
+
+typedef struct
+{
+  Token tok;
+  Hideset *hs;
+} PPToken;
+
+// Growable token array. A stream reads its pending tokens from the end.
+typedef struct
+{
+  PPToken *data;
+  int len;
+  int cap;
+} PPTokens;
+
+typedef struct
+{
+  PPTokens pending; // Read before anything else, last one first
+  bool files;       // Go on to the open files once pending runs out
+} PPStream;
+
+static Arena pp_arena;     // Hide-sets
+static PPFile *pp_file;    // Innermost file being read
+static PPStream pp_stream; // What the parser pulls from
+static Token pp_eof;       // End of the main input
+static int macro_file = -1; // Source file for macro bodies with no #define line
+static Hideset hs_all;     // Hides every macro
+
+static void toks_push(PPTokens *v, const PPToken *t)
+{
+  if (v->len == v->cap)
+  {
+    v->cap = v->cap ? v->cap * 2 : 64;
+    v->data = realloc(v->data, sizeof(PPToken) * v->cap);
+    if (!v->data)
+    {
+      fprintf(stderr, "[preprocess] Out of memory\n");
+      exit(1);
+    }
+  }
+  v->data[v->len++] = *t;
+}
+
+static bool hs_contains(Hideset *hs, const char *name)
+{
+  if (hs == &hs_all)
+    return true;
+  for (; hs; hs = hs->next)
+    if (hs->name == name)
+      return true;
+  return false;
+}
+
+static Hideset *hs_add(Hideset *hs, const char *name)
+{
+  Hideset *h = arena_alloc(&pp_arena, sizeof(Hideset));
+  h->name = name;
+  h->next = hs;
+  return h;
+}
+
+static Hideset *hs_union(Hideset *a, Hideset *b)
+{
+  if (!a || a == b)
+    return b;
+  for (; a; a = a->next)
+    if (!hs_contains(b, a->name))
+      b = hs_add(b, a->name);
+  return b;
+}
+
+static Hideset *hs_intersect(Hideset *a, Hideset *b)
+{
+  Hideset *hs = NULL;
+  for (; a; a = a->next)
+    if (hs_contains(b, a->name))
+      hs = hs_add(hs, a->name);
+  return hs;
+}
+
+static bool is_punct(const Token *tok, char c)
+{
+  return tok->kind == TK_RESERVED && tok->len == 1 && tok->str[0] == c;
+}
+
+// Opens a file for reading at the top of the include stack. A header read
+// again keeps the source file it was given the first time, as its text is
+// the same.
+static void pp_enter(IncludeFile *inc, const char *name, const char *text)
+{
+  PPFile *f = calloc(1, sizeof(PPFile));
+  f->parent = pp_file;
+  f->inc = inc;
+  f->path = name;
+  if (!inc)
+    f->file_id = source_file_add(name, text);
+  else
+  {
+    if (inc->file_id < 0)
+      inc->file_id = source_file_add(name, text);
+    f->file_id = inc->file_id;
+  }
+  f->p = text;
+  f->end = inc ? inc->text.data + inc->text.len : text + strlen(text);
+  f->ahead = lex_ahead((char *)text, f->end - text, f->file_id);
+  f->line_start = true;
+  f->is_active = 1;
+  pp_file = f;
+}
+
+// Opens a built-in header for reading from its precompiled image, if the
+// image holds. Returns false if the text has to be read instead.
+static bool pp_enter_image(IncludeFile *inc)
+{
+  int count;
+  Token *tokens = inc->image ? pch_include(inc, &count) : NULL;
+  if (!tokens)
+    return false;
+  PPFile *f = calloc(1, sizeof(PPFile));
+  f->parent = pp_file;
+  f->inc = inc;
+  f->path = inc->path;
+  f->file_id = inc->file_id;
+  f->image = tokens;
+  f->image_len = count;
+  f->is_active = 1;
+  pp_file = f;
+  return true;
+}
+
+// Skips an inactive region, jumping from one directive line to the next
+// until one ends the region. p is at the end of the directive that began it.
+static void pp_skip_inactive(PPFile *f)
+{
+  const char *p = f->p;
+  if (*p == '\r')
+    p++;
+  if (*p == '\n')
+    p++;
+  while (!f->is_active && (p = next_directive(p, f->end)) < f->end)
+  {
+    const char *line_end = line_end_of(p);
+    const char *q = p;
+    while (*q != '#')
+      q++;
+    run_directive(f, p, q + 1, line_end);
+    p = line_end;
+    if (*p == '\r')
+      p++;
+    if (*p == '\n')
+      p++;
+  }
+  f->p = p;
+  f->line_start = true;
+}
+
+// Lexes the next token of the open files, running directives on the way.
+// Returns false once the main input is exhausted.
+static bool pp_lex(PPToken *out)
+{
+  while (pp_file)
+  {
+    PPFile *f = pp_file;
+    if (f->image)
+    {
+      if (f->image_pos < f->image_len)
+      {
+        out->tok = f->image[f->image_pos++];
+        out->hs = &hs_all;
+        return true;
+      }
+      pp_file = f->parent;
+      free(f->image);
+      free(f);
+      continue;
+    }
+    if (!f->is_active)
+      pp_skip_inactive(f);
+    char *p = (char *)f->p;
+    bool line_break = f->ahead ? lex_ahead_token(f->ahead, &p, &out->tok) : lex_pp_token(&p, f->file_id, &out->tok);
+    bool line_start = line_break || f->line_start;
+    f->p = p;
+    f->line_start = false;
+    if (out->tok.kind == TK_EOF)
+    {
+      pp_file = f->parent;
+      lex_ahead_free(f->ahead);
+      free(f);
+      if (!pp_file)
+        pp_eof = out->tok;
+      continue;
+    }
+    if (line_start && is_punct(&out->tok, '#'))
+    {
+      const char *line_end = line_end_of(f->p);
+      IncludeFile *inc = run_directive(f, out->tok.str, f->p, line_end);
+      f->p = line_end;
+      f->line_start = true;
+      if (inc && !pp_enter_image(inc))
+        pp_enter(inc, inc->path, inc->text.data);
+      continue;
+    }
+    out->hs = NULL;
+    return true;
+  }
+  return false;
+}
+
+static bool pp_read(PPStream *s, PPToken *out)
+{
+  if (s->pending.len)
+  {
+    *out = s->pending.data[--s->pending.len];
+    return true;
+  }
+  return s->files && pp_lex(out);
+}
+
+// Lexes a macro's value on first use, from its #define line when that is
+// still mapped
+static void macro_body(MacroDef *m)
+{
+  if (m->body || !*m->value)
+    return;
+  char *p = (char *)(m->src ? m->src : m->value);
+  int file = m->src ? m->src_file : macro_file;
+  if (file < 0)
+    file = macro_file = source_file_add("<macro>", NULL);
+  int cap = 8;
+  m->body = malloc(sizeof(Token) * cap);
+  for (;;)
+  {
+    Token tok = {0};
+    if (lex_pp_token(&p, file, &tok) || tok.kind == TK_EOF)
+      break;
+    if (m->body_len == cap)
+      m->body = realloc(m->body, sizeof(Token) * (cap *= 2));
+    m->body[m->body_len++] = tok;
+  }
+}
+
+static bool pp_expand(PPStream *s, PPToken *out);
+
+// Expands tokens on their own, as a macro argument is before it is
+// substituted, appending the result to out
+static void expand_tokens(const PPToken *toks, int n, PPTokens *out)
+{
+  PPStream sub = {0};
+  for (int i = n - 1; i >= 0; i--)
+    toks_push(&sub.pending, &toks[i]);
+  PPToken t;
+  while (pp_expand(&sub, &t))
+    toks_push(out, &t);
+  free(sub.pending.data);
+}
+
+// Reads the arguments of a call to m, after its '('. Each argument is a run
+// of args starting at (*starts)[i]; (*starts)[argc] ends the last one. The
+// caller frees *starts. Returns false if the input ends first.
+static bool read_args(PPStream *s, PPTokens *args, int **starts, int *argc, PPToken *rparen)
+{
+  int depth = 0, cap = 8;
+  *argc = 0;
+  *starts = malloc(sizeof(int) * cap);
+  if (!*starts)
+    goto oom;
+  (*starts)[0] = 0;
+  PPToken t;
+  while (pp_read(s, &t))
+  {
+    if (depth == 0 && (is_punct(&t.tok, ',') || is_punct(&t.tok, ')')))
+    {
+      if (*argc + 1 == cap)
+      {
+        cap *= 2;
+        *starts = realloc(*starts, sizeof(int) * cap);
+        if (!*starts)
+          goto oom;
+      }
+      (*starts)[++*argc] = args->len;
+      if (is_punct(&t.tok, ')'))
+      {
+        *rparen = t;
+        return true;
+      }
+      continue;
+    }
+    if (is_punct(&t.tok, '('))
+      depth++;
+    else if (is_punct(&t.tok, ')'))
+      depth--;
+    toks_push(args, &t);
+  }
+  return false;
+oom:
+  fprintf(stderr, "[preprocess] Out of memory\n");
+  exit(1);
+}
+
+// Substitutes the arguments into m's body and pushes the result back onto
+// s, tagged with hs, to be rescanned
+static void substitute(PPStream *s, MacroDef *m, PPTokens *args, int *starts, int argc, Hideset *hs)
+{
+  // One slot per parameter; arguments past the last parameter are unused
+  PPTokens *expanded = NULL;
+  bool *done = NULL;
+  if (m->param_count && (!(expanded = calloc(m->param_count, sizeof(PPTokens))) ||
+                         !(done = calloc(m->param_count, sizeof(bool)))))
+  {
+    fprintf(stderr, "[preprocess] Out of memory\n");
+    exit(1);
+  }
+  PPTokens body = {0};
+  for (int i = 0; i < m->body_len; i++)
+  {
+    Token *b = &m->body[i];
+    int param = 0;
+    while (b->kind == TK_IDENT && param < m->param_count && m->params[param] != b->name)
+      param++;
+    if (b->kind != TK_IDENT || param == m->param_count)
+    {
+      PPToken t = {*b, hs};
+      toks_push(&body, &t);
+      continue;
+    }
+    if (param >= argc)
+      continue;
+    // Arguments are expanded fully, once, before they are substituted
+    if (!done[param])
+    {
+      expand_tokens(args->data + starts[param], starts[param + 1] - starts[param], &expanded[param]);
+      done[param] = true;
+    }
+    for (int j = 0; j < expanded[param].len; j++)
+    {
+      PPToken t = expanded[param].data[j];
+      t.hs = hs_union(t.hs, hs);
+      toks_push(&body, &t);
+    }
+  }
+  for (int i = body.len - 1; i >= 0; i--)
+    toks_push(&s->pending, &body.data[i]);
+  for (int i = 0; i < m->param_count; i++)
+    free(expanded[i].data);
+  free(expanded);
+  free(done);
+  free(body.data);
+}
+
+// Reads the next token of s with macros expanded. Returns false at the end.
+static bool pp_expand(PPStream *s, PPToken *out)
+{
+  while (pp_read(s, out))
+  {
+    Token *tok = &out->tok;
+    if (tok->kind != TK_IDENT && tok->kind != TK_KEYWORD)
+      return true;
+    // A keyword that was never interned cannot be a macro; a watcher sees
+    // it all the same
+    const char *name;
+    if (tok->kind == TK_IDENT)
+      name = tok->name;
+    else
+      name = macro_watch ? intern(tok->str, tok->len) : intern_find(tok->str, tok->len);
+    MacroDef *m = name ? macro_lookup(name) : NULL;
+    if (!m || hs_contains(out->hs, name))
+      return true;
+    macro_body(m);
+    if (!m->is_function)
+    {
+      substitute(s, m, NULL, NULL, 0, hs_add(out->hs, name));
+      continue;
+    }
+    // A function-like macro name is only a call when '(' follows
+    PPToken next;
+    if (!pp_read(s, &next))
+      return true;
+    if (!is_punct(&next.tok, '('))
+    {
+      toks_push(&s->pending, &next);
+      return true;
+    }
+    PPTokens args = {0};
+    int *starts;
+    int argc;
+    PPToken rparen;
+    if (!read_args(s, &args, &starts, &argc, &rparen))
+    {
+      fprintf(stderr, "[preprocess] Unterminated call to macro %s\n", name);
+      free(starts);
+      free(args.data);
+      return true;
+    }
+    Hideset *hs = hs_add(hs_intersect(out->hs, rparen.hs), name);
+    substitute(s, m, &args, starts, argc, hs);
+    free(starts);
+    free(args.data);
+  }
+  return false;
+}
+
+int pp_current_file(void)
+{
+  return pp_file ? pp_file->file_id : -1;
+}
+
+static void pp_produce(Token *tok)
+{
+  PPToken t;
+  if (pp_expand(&pp_stream, &t))
+    *tok = t.tok;
+  else
+    *tok = pp_eof;
+  tok->next = NULL;
+}
+
+// Starts preprocessing input, the text of input_file, into a token stream
+// for the parser. Tokens are produced as the parser asks for them unless
+// eager is set; see token_stream().
+Token *preprocess_tokens(const char *input_file, const char *input, bool eager)
+{
+  TRACE(TRACE_PP, 1, "preprocessing %s to tokens", input_file);
+  pp_stream.files = true;
+  pp_stream.pending.len = 0;
+  pp_enter(NULL, input_file, input);
+  return token_stream(pp_produce, eager);
+}
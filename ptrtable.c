@@ -0,0 +1,81 @@
+// ptrtable.c - Open-addressing hash tables keyed by pointer
+//
+// Most symbol tables here are keyed by an interned name or some other
+// pointer that is unique per key, so keys are matched by pointer and never
+// compared as strings. A table's slots are structs of the caller's choosing
+// whose first member is the key; a NULL key marks an empty slot. Tables are
+// probed linearly, hold at most half their slots and double when they fill.
+#include "lawsa.h"
+
+#define PTR_TABLE_MIN_CAP 64
+
+uint32_t hash_ptr(const void *p)
+{
+    return (uint32_t)(((uintptr_t)p >> 3) * 2654435761u);
+}
+
+static const void *slot_key(const PtrTable *t, uint32_t i)
+{
+    return *(const void **)((char *)t->slots + (size_t)i * t->slot_size);
+}
+
+// Index of key's slot, or of the empty slot where it would go
+static uint32_t probe(const PtrTable *t, const void *key)
+{
+    uint32_t mask = t->cap - 1;
+    uint32_t i = hash_ptr(key) & mask;
+    const void *k;
+    while ((k = slot_key(t, i)) && k != key)
+        i = (i + 1) & mask;
+    return i;
+}
+
+static void grow(PtrTable *t)
+{
+    char *old = t->slots;
+    uint32_t old_cap = t->cap;
+    t->cap = old_cap ? old_cap * 2 : PTR_TABLE_MIN_CAP;
+    t->slots = calloc(t->cap, t->slot_size);
+    for (uint32_t i = 0; i < old_cap; i++)
+    {
+        char *slot = old + (size_t)i * t->slot_size;
+        if (*(void **)slot)
+            memcpy((char *)t->slots + (size_t)probe(t, *(void **)slot) * t->slot_size, slot, t->slot_size);
+    }
+    free(old);
+}
+
+// Returns key's slot, or NULL if the key is not in the table
+void *ptr_table_find(const PtrTable *t, const void *key)
+{
+    if (!t->cap)
+        return NULL;
+    char *slot = (char *)t->slots + (size_t)probe(t, key) * t->slot_size;
+    return *(void **)slot ? slot : NULL;
+}
+
+// Returns key's slot, adding a zeroed one holding just the key if there is
+// none; *added (if not NULL) says which. Adding may move every slot, so a
+// slot pointer is only good until the next ptr_table_put().
+void *ptr_table_put(PtrTable *t, const void *key, bool *added)
+{
+    if (t->count * 2 >= t->cap)
+        grow(t);
+    char *slot = (char *)t->slots + (size_t)probe(t, key) * t->slot_size;
+    bool is_new = !*(void **)slot;
+    if (is_new)
+    {
+        *(const void **)slot = key;
+        t->count++;
+    }
+    if (added)
+        *added = is_new;
+    return slot;
+}
+
+void ptr_table_free(PtrTable *t)
+{
+    free(t->slots);
+    t->slots = NULL;
+    t->cap = t->count = 0;
+}
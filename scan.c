@@ -0,0 +1,211 @@
+// scan.c - Vectorized scanning of whitespace, comments, identifiers and strings
+//
+// Each scanner looks for the first byte that ends a run and returns a pointer
+// to it. The input must be NUL-terminated; NUL always ends a run. On x86 the
+// runs are searched 16 (SSE2) or 32 (AVX2) bytes at a time, picked once at
+// runtime, with a byte-class table as the portable fallback. Vector loads are
+// aligned to their width so they never cross into an unmapped page.
+// Setting LAWSA_SCAN_SCALAR in the environment forces the fallback.
+#include "lawsa.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+const uint8_t char_class[256] = {
+    ['\t'] = CC_SPACE, ['\n'] = CC_SPACE, ['\v'] = CC_SPACE,
+    ['\f'] = CC_SPACE, ['\r'] = CC_SPACE, [' '] = CC_SPACE,
+    ['a' ... 'z'] = CC_ALPHA, ['A' ... 'Z'] = CC_ALPHA, ['_'] = CC_ALPHA,
+    ['0' ... '9'] = CC_DIGIT,
+};
+
+// What ends a run, per scanner
+typedef enum
+{
+    SCAN_SPACE,  // first non-whitespace byte
+    SCAN_IDENT,  // first byte that cannot continue an identifier
+    SCAN_LINE,   // '\n' or NUL
+    SCAN_STAR,   // '*' or NUL
+    SCAN_STRING, // '"', '\\', '\n' or NUL
+} ScanKind;
+
+static const char *scan_scalar(const char *p, ScanKind kind)
+{
+    switch (kind)
+    {
+    case SCAN_SPACE:
+        while (char_class[(unsigned char)*p] & CC_SPACE)
+            p++;
+        return p;
+    case SCAN_IDENT:
+        while (char_class[(unsigned char)*p] & (CC_ALPHA | CC_DIGIT))
+            p++;
+        return p;
+    case SCAN_LINE:
+        while (*p && *p != '\n')
+            p++;
+        return p;
+    case SCAN_STAR:
+        while (*p && *p != '*')
+            p++;
+        return p;
+    case SCAN_STRING:
+        while (*p && *p != '"' && *p != '\\' && *p != '\n')
+            p++;
+        return p;
+    }
+    return p;
+}
+
+#ifdef SCAN_X86
+// Byte lanes of v that end a run of the given kind
+static inline __m128i sse2_stop(__m128i v, ScanKind kind)
+{
+    __m128i nul = _mm_cmpeq_epi8(v, _mm_setzero_si128());
+    switch (kind)
+    {
+    case SCAN_SPACE:
+    {
+        // ' ' or 9..13, as an unsigned range check on v - 9
+        __m128i r = _mm_sub_epi8(v, _mm_set1_epi8(9));
+        __m128i ctl = _mm_cmpeq_epi8(_mm_min_epu8(r, _mm_set1_epi8(4)), r);
+        __m128i sp = _mm_or_si128(ctl, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+        return _mm_xor_si128(sp, _mm_set1_epi8(-1));
+    }
+    case SCAN_IDENT:
+    {
+        __m128i lo = _mm_sub_epi8(_mm_or_si128(v, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+        __m128i alpha = _mm_cmpeq_epi8(_mm_min_epu8(lo, _mm_set1_epi8(25)), lo);
+        __m128i d = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+        __m128i digit = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+        __m128i under = _mm_cmpeq_epi8(v, _mm_set1_epi8('_'));
+        __m128i ident = _mm_or_si128(_mm_or_si128(alpha, digit), under);
+        return _mm_xor_si128(ident, _mm_set1_epi8(-1));
+    }
+    case SCAN_LINE:
+        return _mm_or_si128(nul, _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+    case SCAN_STAR:
+        return _mm_or_si128(nul, _mm_cmpeq_epi8(v, _mm_set1_epi8('*')));
+    case SCAN_STRING:
+        return _mm_or_si128(_mm_or_si128(nul, _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))),
+                            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                                         _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))));
+    }
+    return nul;
+}
+
+static const char *scan_sse2(const char *p, ScanKind kind)
+{
+    const char *blk = (const char *)((uintptr_t)p & ~(uintptr_t)15);
+    unsigned mask = _mm_movemask_epi8(sse2_stop(_mm_load_si128((const __m128i *)blk), kind));
+    mask &= 0xFFFFu << (p - blk);
+    while (!mask)
+    {
+        blk += 16;
+        mask = _mm_movemask_epi8(sse2_stop(_mm_load_si128((const __m128i *)blk), kind));
+    }
+    return blk + __builtin_ctz(mask);
+}
+
+__attribute__((target("avx2"))) static inline __m256i avx2_stop(__m256i v, ScanKind kind)
+{
+    __m256i nul = _mm256_cmpeq_epi8(v, _mm256_setzero_si256());
+    switch (kind)
+    {
+    case SCAN_SPACE:
+    {
+        __m256i r = _mm256_sub_epi8(v, _mm256_set1_epi8(9));
+        __m256i ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(r, _mm256_set1_epi8(4)), r);
+        __m256i sp = _mm256_or_si256(ctl, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+        return _mm256_xor_si256(sp, _mm256_set1_epi8(-1));
+    }
+    case SCAN_IDENT:
+    {
+        __m256i lo = _mm256_sub_epi8(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+        __m256i alpha = _mm256_cmpeq_epi8(_mm256_min_epu8(lo, _mm256_set1_epi8(25)), lo);
+        __m256i d = _mm256_sub_epi8(v, _mm256_set1_epi8('0'));
+        __m256i digit = _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(9)), d);
+        __m256i under = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_'));
+        __m256i ident = _mm256_or_si256(_mm256_or_si256(alpha, digit), under);
+        return _mm256_xor_si256(ident, _mm256_set1_epi8(-1));
+    }
+    case SCAN_LINE:
+        return _mm256_or_si256(nul, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+    case SCAN_STAR:
+        return _mm256_or_si256(nul, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('*')));
+    case SCAN_STRING:
+        return _mm256_or_si256(_mm256_or_si256(nul, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'))),
+                               _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+                                               _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))));
+    }
+    return nul;
+}
+
+__attribute__((target("avx2"))) static const char *scan_avx2(const char *p, ScanKind kind)
+{
+    const char *blk = (const char *)((uintptr_t)p & ~(uintptr_t)31);
+    uint32_t mask = _mm256_movemask_epi8(avx2_stop(_mm256_load_si256((const __m256i *)blk), kind));
+    mask &= 0xFFFFFFFFu << (p - blk);
+    while (!mask)
+    {
+        blk += 32;
+        mask = _mm256_movemask_epi8(avx2_stop(_mm256_load_si256((const __m256i *)blk), kind));
+    }
+    return blk + __builtin_ctz(mask);
+}
+#endif
+
+// The first call picks the widest implementation the CPU supports
+static const char *scan_resolve(const char *p, ScanKind kind);
+static const char *(*scan_impl)(const char *p, ScanKind kind) = scan_resolve;
+
+static const char *scan_resolve(const char *p, ScanKind kind)
+{
+    scan_impl = scan_scalar;
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        scan_impl = scan_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        scan_impl = scan_sse2;
+#endif
+    if (getenv("LAWSA_SCAN_SCALAR"))
+        scan_impl = scan_scalar;
+    return scan_impl(p, kind);
+}
+
+const char *scan_skip_space(const char *p)
+{
+    return scan_impl(p, SCAN_SPACE);
+}
+
+const char *scan_ident_end(const char *p)
+{
+    return scan_impl(p, SCAN_IDENT);
+}
+
+const char *scan_line_end(const char *p)
+{
+    return scan_impl(p, SCAN_LINE);
+}
+
+// p points just past the opening "/*". Returns the byte after the closing
+// "*/", or the terminating NUL of an unterminated comment.
+const char *scan_comment_end(const char *p)
+{
+    for (;;)
+    {
+        p = scan_impl(p, SCAN_STAR);
+        if (!*p)
+            return p;
+        if (p[1] == '/')
+            return p + 2;
+        p++;
+    }
+}
+
+const char *scan_string_end(const char *p)
+{
+    return scan_impl(p, SCAN_STRING);
+}
@@ -0,0 +1,149 @@
+// source.c - Source input buffers
+//
+// Regular files are mapped read-only rather than copied. The mapping is
+// followed by at least one zero page, so every buffer is NUL-terminated and
+// the vector scanners may read to the end of the page holding the NUL.
+// Pipes and other streams are read in fixed blocks and copied once.
+#define _DEFAULT_SOURCE // mmap flags, fdopen
+#include "lawsa.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define SOURCE_BLOCK_SIZE (64 * 1024)
+
+// Skips a UTF-8 byte order mark by moving the start of the text
+static void skip_bom(SourceBuffer *buf)
+{
+    if (buf->len >= 3 &&
+        (unsigned char)buf->data[0] == 0xEF &&
+        (unsigned char)buf->data[1] == 0xBB &&
+        (unsigned char)buf->data[2] == 0xBF)
+    {
+        buf->data += 3;
+        buf->len -= 3;
+    }
+}
+
+#ifndef _WIN32
+static bool map_file(SourceBuffer *buf, int fd, size_t size)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t map_len = (size + page - 1) / page * page + page;
+    // Reserve the file pages plus a zero sentinel page, then map the file
+    // over the front of the reservation.
+    char *base = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return false;
+    if (mmap(base, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        munmap(base, map_len);
+        return false;
+    }
+    buf->map = base;
+    buf->map_len = map_len;
+    buf->data = base;
+    buf->len = size;
+    return true;
+}
+#endif
+
+// Reads a stream to EOF in fixed blocks, then copies the blocks once into
+// a single NUL-terminated buffer of the exact size.
+bool source_read_stream(SourceBuffer *buf, FILE *fp)
+{
+    typedef struct Block
+    {
+        struct Block *next;
+        size_t len;
+        char data[SOURCE_BLOCK_SIZE];
+    } Block;
+    Block *head = NULL, **tail = &head;
+    size_t total = 0;
+
+    memset(buf, 0, sizeof(*buf));
+    for (;;)
+    {
+        Block *b = malloc(sizeof(Block));
+        if (!b)
+            break;
+        b->next = NULL;
+        b->len = fread(b->data, 1, SOURCE_BLOCK_SIZE, fp);
+        *tail = b;
+        tail = &b->next;
+        total += b->len;
+        if (b->len < SOURCE_BLOCK_SIZE)
+            break;
+    }
+
+    char *out = malloc(total + 1);
+    size_t pos = 0;
+    for (Block *b = head; b;)
+    {
+        Block *next = b->next;
+        if (out)
+            memcpy(out + pos, b->data, b->len);
+        pos += b->len;
+        free(b);
+        b = next;
+    }
+    if (!out)
+        return false;
+    out[total] = 0;
+    buf->alloc = out;
+    buf->data = out;
+    buf->len = total;
+    skip_bom(buf);
+    return true;
+}
+
+// Opens a source file, mapping it when it is a regular file
+bool source_open(SourceBuffer *buf, const char *path)
+{
+    memset(buf, 0, sizeof(*buf));
+#ifndef _WIN32
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+    {
+        bool ok;
+        if (st.st_size == 0)
+        {
+            buf->data = "";
+            ok = true;
+        }
+        else
+        {
+            ok = map_file(buf, fd, (size_t)st.st_size);
+        }
+        close(fd);
+        if (ok)
+            skip_bom(buf);
+        return ok;
+    }
+    FILE *fp = fdopen(fd, "rb");
+#else
+    FILE *fp = fopen(path, "rb");
+#endif
+    if (!fp)
+        return false;
+    bool ok = source_read_stream(buf, fp);
+    fclose(fp);
+    return ok;
+}
+
+void source_close(SourceBuffer *buf)
+{
+#ifndef _WIN32
+    if (buf->map)
+        munmap(buf->map, buf->map_len);
+#endif
+    free(buf->alloc);
+    memset(buf, 0, sizeof(*buf));
+}
@@ -2,6 +2,7 @@
 #define _STDIO_H
 
 #include <stdarg.h>
+#include <stddef.h>
 
 typedef struct _FILE FILE;
 extern FILE *stdin;
@@ -0,0 +1,158 @@
+// bench_tokenize.c - Tokenizer throughput microbenchmark
+//
+// Builds an identifier-dense corpus in memory (declarations, calls and
+// assignments where most tokens are identifiers or keywords) and times
+// repeated passes of lex_pp_token(), the lexer the preprocessor drives, over
+// it. It then times keyword classification alone over the corpus's words,
+// with keyword_id() and with the linear keyword loop it replaced. Build and
+// run with `make bench`.
+#include "../lawsa.h"
+#include <time.h>
+
+char *user_input;
+Token *token;
+
+void error(char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+void error_at(Token *tok, char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+// Identifiers are chosen to collide with keywords on length and first
+// character as often as possible, which is the worst case for classification.
+static const char *idents[] = {
+    "i", "it", "iff", "int_value", "do_work", "dst", "format", "foo",
+    "element", "elsewhere", "enumerate", "character", "chars", "case_count",
+    "long_name", "loop", "go", "gotoNext", "whilst", "shorten", "floaty",
+    "constant", "unionize", "breaker", "returned", "doubled", "signal",
+    "sizes", "statics", "structure", "switcher", "typedefs", "defaults",
+    "unsigned_", "volatility", "registers", "continuum", "value", "x", "y",
+};
+
+static const char *stmts[] = {
+    "int %s = %s + %s;\n",
+    "%s = %s(%s, %s);\n",
+    "if (%s < %s) return %s;\n",
+    "unsigned long %s = %s * %s;\n",
+    "while (%s) %s = %s - %s;\n",
+    "struct %s %s; %s.%s = %s;\n",
+};
+
+// The classifier keyword_id() replaced: a linear scan over every keyword
+static bool linear_is_keyword(const char *p, int len)
+{
+    static const char *kw[] = {"if", "else", "while", "for", "return",
+        "void", "char", "short", "int", "long", "float", "double",
+        "signed", "unsigned", "const", "volatile",
+        "struct", "union", "enum", "typedef",
+        "sizeof", "static", "extern", "register", "break",
+        "continue", "switch", "case", "default", "do", "goto"};
+    for (int i = 0; i < sizeof(kw) / sizeof(*kw); i++)
+        if (strlen(kw[i]) == len && !strncmp(p, kw[i], len))
+            return true;
+    return false;
+}
+
+static double seconds_since(const struct timespec *start)
+{
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static char *build_corpus(size_t target, int *lines)
+{
+    size_t cap = target + 256, len = 0;
+    char *buf = malloc(cap);
+    int nidents = sizeof(idents) / sizeof(*idents);
+    int nstmts = sizeof(stmts) / sizeof(*stmts);
+    unsigned seed = 12345;
+    *lines = 0;
+    while (len < target)
+    {
+        const char *a[5];
+        for (int i = 0; i < 5; i++)
+        {
+            seed = seed * 1103515245 + 12345;
+            a[i] = idents[(seed >> 16) % nidents];
+        }
+        seed = seed * 1103515245 + 12345;
+        len += snprintf(buf + len, cap - len, stmts[(seed >> 16) % nstmts],
+                        a[0], a[1], a[2], a[3], a[4]);
+        (*lines)++;
+    }
+    buf[len] = 0;
+    return buf;
+}
+
+int main(int argc, char **argv)
+{
+    size_t size = argc > 1 ? strtoul(argv[1], NULL, 10) : 1024 * 1024;
+    int iters = argc > 2 ? atoi(argv[2]) : 10;
+    int lines;
+    char *corpus = build_corpus(size, &lines);
+    size_t bytes = strlen(corpus);
+
+    int file = source_file_add("<bench>", corpus);
+    long ntokens = 0;
+    struct timespec start;
+    timespec_get(&start, TIME_UTC);
+    for (int i = 0; i < iters; i++)
+    {
+        ntokens = 0;
+        Token tok;
+        for (char *p = corpus; lex_pp_token(&p, file, &tok), tok.kind != TK_EOF;)
+            ntokens++;
+    }
+    double secs = seconds_since(&start);
+
+    printf("corpus:     %zu bytes, %d lines, %ld tokens\n", bytes, lines, ntokens);
+    printf("iterations: %d in %.3f s\n", iters, secs);
+    printf("throughput: %.1f MB/s, %.1f Mtok/s\n",
+           bytes * (double)iters / secs / 1e6, ntokens * (double)iters / secs / 1e6);
+
+    // The words the classifier sees: every identifier and keyword
+    Token *words = malloc(sizeof(Token) * ntokens);
+    long nwords = 0;
+    Token tok;
+    for (char *p = corpus; lex_pp_token(&p, file, &tok), tok.kind != TK_EOF;)
+        if (tok.kind == TK_IDENT || tok.kind == TK_KEYWORD)
+            words[nwords++] = tok;
+
+    long hits = 0;
+    timespec_get(&start, TIME_UTC);
+    for (int i = 0; i < iters; i++)
+        for (long j = 0; j < nwords; j++)
+            hits += linear_is_keyword(words[j].str, words[j].len);
+    double linear_secs = seconds_since(&start);
+
+    long switch_hits = 0;
+    timespec_get(&start, TIME_UTC);
+    for (int i = 0; i < iters; i++)
+        for (long j = 0; j < nwords; j++)
+            switch_hits += keyword_id(words[j].str, words[j].len) != KW_NONE;
+    double switch_secs = seconds_since(&start);
+
+    printf("keywords:   %ld of %ld words\n", switch_hits / iters, nwords);
+    printf("  linear loop:   %.3f s, %.1f ns/word\n", linear_secs, linear_secs * 1e9 / nwords / iters);
+    printf("  keyword_id():  %.3f s, %.1f ns/word, %.1fx faster\n", switch_secs,
+           switch_secs * 1e9 / nwords / iters, linear_secs / switch_secs);
+    if (hits != switch_hits)
+        printf("  (the linear loop found %ld keywords)\n", hits / iters);
+    free(words);
+    return 0;
+}
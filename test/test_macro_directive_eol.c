@@ -0,0 +1,11 @@
+// Test: #else and #endif with nothing after them, the last one ending the file
+#ifdef UNDEFINED_MACRO
+int a = 1;
+#else
+int a = 2;
+#endif // not taken above
+#ifndef UNDEFINED_MACRO
+int b = 3;
+#else
+int b = 4;
+#endif
\ No newline at end of file
@@ -0,0 +1,2 @@
+int a = 2;
+int b = 3;
@@ -0,0 +1,3 @@
+int c = 4;
+int e = 6;
+int f = 1;
\ No newline at end of file
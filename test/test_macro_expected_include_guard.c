@@ -0,0 +1,3 @@
+int guarded;
+int once;
+int main_value = 1 + 2;
\ No newline at end of file
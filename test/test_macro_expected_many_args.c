@@ -0,0 +1 @@
+int x = 1 + 32 + 33 + 40;
\ No newline at end of file
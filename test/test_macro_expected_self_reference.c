@@ -0,0 +1,3 @@
+int x = foo + 1;
+int y = a;
+int z = f(foo + 1) * 2;
\ No newline at end of file
@@ -0,0 +1,5 @@
+#ifndef TEST_MACRO_GUARDED_H
+#define TEST_MACRO_GUARDED_H
+#define GUARDED_VALUE 1
+int guarded;
+#endif
\ No newline at end of file
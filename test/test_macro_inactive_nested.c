@@ -0,0 +1,24 @@
+// Test: Nested conditionals inside inactive regions are skipped whole
+#define ON 1
+#ifdef OFF
+#ifdef ON
+int a = 1;
+#else
+int a = 2;
+#endif
+#ifndef ON
+int b = 3;
+#endif
+#else
+#ifndef OFF
+int c = 4;
+#ifdef OFF
+#ifdef ON
+int d = 5;
+#endif
+#else
+int e = 6;
+#endif
+#endif
+#endif
+int f = ON;
\ No newline at end of file
@@ -0,0 +1,6 @@
+// Test: Guarded and #pragma once headers are read once however often included
+#include "test_macro_guarded.h"
+#include "test_macro_once.h"
+#include "test_macro_guarded.h"
+#include "test_macro_once.h"
+int main_value = GUARDED_VALUE + ONCE_VALUE;
\ No newline at end of file
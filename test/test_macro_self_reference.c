@@ -0,0 +1,8 @@
+// Test: Self-referential macros expand once and then stop
+#define foo foo + 1
+#define a b
+#define b a
+#define f(x) f(x) * 2
+int x = foo;
+int y = a;
+int z = f(foo);
\ No newline at end of file
@@ -1,13 +1,18 @@
 /* tokenize.c - cleaned and refactored */
+#define _DEFAULT_SOURCE // sysconf
 #include "lawsa.h"
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <ctype.h>
 #include "preprocess.h"
+#ifndef _WIN32
+#include <pthread.h>
+#include <unistd.h>
+#endif
 
 // Add at the very top of the file
-__attribute__((constructor)) static void file_loaded_notice() { fprintf(stderr, "[DEBUG] tokenize.c loaded\n"); }
+__attribute__((constructor)) static void file_loaded_notice() { TRACE(TRACE_LEX, 2, "tokenize.c loaded"); }
 
 // Custom strndup
 static char *my_strndup(const char *s, size_t n)
@@ -31,7 +36,7 @@ bool consume(char *op)
         memcmp(token->str, op, token->len) != 0)
         return false;
     prev_token = token;
-    token = token->next;
+    token = next_token(token);
     return true;
 }
 
@@ -49,7 +54,7 @@ Token *consume_ident(void)
     if (token->kind != TK_IDENT)
         return NULL;
     Token *t = token;
-    token = token->next;
+    token = next_token(token);
     return t;
 }
 
@@ -58,7 +63,7 @@ bool consume_keyword(char *kw)
     if (token->kind != TK_KEYWORD || token->len != strlen(kw) ||
         memcmp(token->str, kw, token->len) != 0)
         return false;
-    token = token->next;
+    token = next_token(token);
     return true;
 }
 
@@ -72,7 +77,7 @@ void expect(char *op)
         else
             error_at(token, "expected '%s', but got '%.*s'", op, token->len, token->str);
     }
-    token = token->next;
+    token = next_token(token);
 }
 
 int expect_number(void)
@@ -80,7 +85,7 @@ int expect_number(void)
     if (token->kind != TK_NUM)
         error_at(token, "expected a number");
     int val = token->val;
-    token = token->next;
+    token = next_token(token);
     return val;
 }
 
@@ -89,7 +94,7 @@ char *expect_ident(void)
     if (token->kind != TK_IDENT)
         error_at(token, "expected an identifier");
     char *s = my_strndup(token->str, token->len);
-    token = token->next;
+    token = next_token(token);
     return s;
 }
 bool at_eof(void)
@@ -97,39 +102,300 @@ bool at_eof(void)
     return token->kind == TK_EOF;
 }
 
+// Lexer state: the next unread byte and the file it belongs to
+typedef struct
+{
+    char *p;
+    int file;
+    bool ahead;  // Lexing ahead on a worker thread; see lex_ahead()
+    bool failed; // An error was found while lexing ahead
+} Lexer;
+
+// Errors found while lexing ahead are left for the preprocessor to find, as
+// it may never read that text
+#define LEX_ERROR(lx, ...) ((lx)->ahead ? (void)((lx)->failed = true) : error_at(token, __VA_ARGS__))
+
+// Token storage: an eager stream allocates every token from this arena; a
+// lazy one cycles through a fixed window of slots instead
+static Arena token_arena;
+#define TOKEN_WINDOW 4096
+static Token *token_window;
+static unsigned token_window_pos;
+static TokenProducer *lazy_source; // Set while a stream is produced on demand
+
+// Releases the current token stream in one go
+void free_tokens(void)
+{
+    arena_release(&token_arena);
+    free(token_window);
+    token_window = NULL;
+    lazy_source = NULL;
+    token = NULL;
+    prev_token = NULL;
+}
+
+// Source files, indexed by Token::file_id
+typedef struct
+{
+    char *name;
+    const char *text;    // Text the file's tokens point into
+    size_t *line_starts; // Offset of each line, built on first use
+    int line_count;
+} SourceFile;
+
+static SourceFile *source_files;
+static int source_file_count;
+static int source_file_cap;
+
+// Registers a file whose tokens point into text, which may be NULL if they
+// have no position. Each call makes a new entry; callers that read the same
+// text again keep the id they got the first time (see pp_enter()). Ids must
+// fit Token::file_id, so running out of them is fatal.
+int source_file_add(const char *name, const char *text)
+{
+    if (source_file_count == UINT16_MAX + 1)
+    {
+        fprintf(stderr, "%s: too many source files (at most %d)\n", name, UINT16_MAX + 1);
+        exit(1);
+    }
+    if (source_file_count == source_file_cap)
+    {
+        source_file_cap = source_file_cap ? source_file_cap * 2 : 64;
+        source_files = realloc(source_files, sizeof(*source_files) * source_file_cap);
+    }
+    source_files[source_file_count] = (SourceFile){.name = my_strndup(name, strlen(name)), .text = text};
+    return source_file_count++;
+}
+
+const char *source_file_name(int file_id)
+{
+    if (file_id < 0 || file_id >= source_file_count)
+        return "<input>";
+    return source_files[file_id].name;
+}
+
+const char *source_file_text(int file_id)
+{
+    if (file_id < 0 || file_id >= source_file_count)
+        return NULL;
+    return source_files[file_id].text;
+}
+
+// Records the text a file's tokens point into, dropping any line table
+// built for earlier text
+void source_file_set_text(int file_id, const char *text)
+{
+    SourceFile *f = &source_files[file_id];
+    f->text = text;
+    free(f->line_starts);
+    f->line_starts = NULL;
+    f->line_count = 0;
+}
+
+static void build_line_starts(SourceFile *f)
+{
+    size_t len = strlen(f->text);
+    int cap = 1024;
+    f->line_starts = malloc(sizeof(size_t) * cap);
+    f->line_starts[0] = 0;
+    f->line_count = 1;
+    for (const char *p = f->text; (p = memchr(p, '\n', f->text + len - p)); p++)
+    {
+        if (f->line_count == cap)
+            f->line_starts = realloc(f->line_starts, sizeof(size_t) * (cap *= 2));
+        f->line_starts[f->line_count++] = p + 1 - f->text;
+    }
+}
+
+// Resolves tok to a 1-based line and byte column. The first call for a file
+// indexes its line starts in one pass; each lookup is a binary search.
+void token_position(Token *tok, int *line, int *column)
+{
+    *line = *column = 0;
+    if (tok->file_id >= source_file_count || !source_files[tok->file_id].text)
+        return;
+    SourceFile *f = &source_files[tok->file_id];
+    if (!f->line_starts)
+        build_line_starts(f);
+    // String literal tokens start after their opening quote
+    size_t offset = tok->str - f->text - (tok->kind == TK_STR);
+    int lo = 0, hi = f->line_count - 1;
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo + 1) / 2;
+        if (f->line_starts[mid] <= offset)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    *line = lo + 1;
+    *column = (int)(offset - f->line_starts[lo]) + 1;
+}
+
 // Token construction
-static Token *new_token(TokenKind kind, Token *cur,
-                        char *str, int len,
-                        const char *file, int line, int col)
+static void new_token(Token *tok, TokenKind kind, char *str, int len, int file_id)
 {
-    Token *tok = calloc(1, sizeof(Token));
     tok->kind = kind;
     tok->str = str;
     tok->len = len;
-    tok->file = file;
-    tok->line = line;
-    tok->column = col;
-    cur->next = tok;
-    return tok;
+    tok->file_id = file_id;
 }
 
 // Identifier tests
-static bool is_ident1(char c) { return isalpha(c) || c == '_'; }
-static bool is_ident2(char c) { return is_ident1(c) || isdigit(c); }
+static bool is_ident1(char c) { return char_class[(unsigned char)c] & CC_ALPHA; }
 
 // Keywords
-static bool is_keyword(const char *p, int len)
+// Classifies an identifier by switching on its length and first character,
+// so at most one memcmp runs per identifier. Returns KW_NONE for
+// non-keywords.
+#define KW_MATCH(s, id)                     \
+    if (!memcmp(p + 1, (s) + 1, len - 1)) \
+        return id;                          \
+    break
+KeywordKind keyword_id(const char *p, int len)
+{
+    switch (len)
+    {
+    case 2:
+        switch (p[0])
+        {
+        case 'i': KW_MATCH("if", KW_IF);
+        case 'd': KW_MATCH("do", KW_DO);
+        }
+        break;
+    case 3:
+        switch (p[0])
+        {
+        case 'f': KW_MATCH("for", KW_FOR);
+        case 'i': KW_MATCH("int", KW_INT);
+        }
+        break;
+    case 4:
+        switch (p[0])
+        {
+        case 'e':
+            if (p[1] == 'l')
+            {
+                KW_MATCH("else", KW_ELSE);
+            }
+            KW_MATCH("enum", KW_ENUM);
+        case 'v': KW_MATCH("void", KW_VOID);
+        case 'c':
+            if (p[1] == 'h')
+            {
+                KW_MATCH("char", KW_CHAR);
+            }
+            KW_MATCH("case", KW_CASE);
+        case 'l': KW_MATCH("long", KW_LONG);
+        case 'g': KW_MATCH("goto", KW_GOTO);
+        }
+        break;
+    case 5:
+        switch (p[0])
+        {
+        case 'w': KW_MATCH("while", KW_WHILE);
+        case 's': KW_MATCH("short", KW_SHORT);
+        case 'f': KW_MATCH("float", KW_FLOAT);
+        case 'c': KW_MATCH("const", KW_CONST);
+        case 'u': KW_MATCH("union", KW_UNION);
+        case 'b': KW_MATCH("break", KW_BREAK);
+        }
+        break;
+    case 6:
+        switch (p[0])
+        {
+        case 'r': KW_MATCH("return", KW_RETURN);
+        case 'd': KW_MATCH("double", KW_DOUBLE);
+        case 'e': KW_MATCH("extern", KW_EXTERN);
+        case 's':
+            switch (p[1])
+            {
+            case 'i':
+                if (p[2] == 'g')
+                {
+                    KW_MATCH("signed", KW_SIGNED);
+                }
+                KW_MATCH("sizeof", KW_SIZEOF);
+            case 't':
+                if (p[3] == 'u')
+                {
+                    KW_MATCH("struct", KW_STRUCT);
+                }
+                KW_MATCH("static", KW_STATIC);
+            case 'w': KW_MATCH("switch", KW_SWITCH);
+            }
+            break;
+        }
+        break;
+    case 7:
+        switch (p[0])
+        {
+        case 't': KW_MATCH("typedef", KW_TYPEDEF);
+        case 'd': KW_MATCH("default", KW_DEFAULT);
+        }
+        break;
+    case 8:
+        switch (p[0])
+        {
+        case 'u': KW_MATCH("unsigned", KW_UNSIGNED);
+        case 'v': KW_MATCH("volatile", KW_VOLATILE);
+        case 'r': KW_MATCH("register", KW_REGISTER);
+        case 'c': KW_MATCH("continue", KW_CONTINUE);
+        }
+        break;
+    }
+    return KW_NONE;
+}
+#undef KW_MATCH
+
+// Punctuators
+// Lexed by maximal munch through a DFA built from this list on first use:
+// one table lookup per character, whatever the number of operators.
+static const char *punctuators[] = {
+    "<<=", ">>=", "...",
+    "==", "!=", "<=", ">=", "+=", "-=", "*=", "/=", "%=", "&=", "|=", "^=",
+    "++", "--", "&&", "||", "<<", ">>", "->",
+    "+", "-", "*", "/", "%", "(", ")", "<", ">", "=", ";", "{", "}", ",",
+    "&", "[", "]", ".", "|", "^", "~", "?", ":", "!"};
+
+#define PUNCT_MAX_STATES 64
+#define PUNCT_DEAD 0
+#define PUNCT_START 1
+static uint8_t punct_dfa[PUNCT_MAX_STATES][256];
+static bool punct_accept[PUNCT_MAX_STATES];
+static int punct_state_count;
+
+static void build_punct_dfa(void)
 {
-    static const char *kw[] = {"if", "else", "while", "for", "return",
-        "void", "char", "short", "int", "long", "float", "double",
-        "signed", "unsigned", "const", "volatile",
-        "struct", "union", "enum", "typedef",
-        "sizeof", "static", "extern", "register", "break",
-        "continue", "switch", "case", "default", "do", "goto"};
-    for (int i = 0; i < sizeof(kw) / sizeof(*kw); i++)
-        if (strlen(kw[i]) == len && !strncmp(p, kw[i], len))
-            return true;
-    return false;
+    punct_state_count = PUNCT_START + 1;
+    for (int i = 0; i < sizeof(punctuators) / sizeof(*punctuators); i++)
+    {
+        int state = PUNCT_START;
+        for (const char *c = punctuators[i]; *c; c++)
+        {
+            uint8_t *next = &punct_dfa[state][(unsigned char)*c];
+            if (*next == PUNCT_DEAD)
+            {
+                assert(punct_state_count < PUNCT_MAX_STATES);
+                *next = punct_state_count++;
+            }
+            state = *next;
+        }
+        punct_accept[state] = true;
+    }
+}
+
+// Returns the length of the longest punctuator at p, or 0 if there is none
+static int read_punct(const char *p)
+{
+    int state = PUNCT_START, len = 0, accepted = 0;
+    while ((state = punct_dfa[state][(unsigned char)p[len]]) != PUNCT_DEAD)
+    {
+        len++;
+        if (punct_accept[state])
+            accepted = len;
+    }
+    return accepted;
 }
 
 // Whitespace & comments
@@ -137,25 +403,19 @@ static char *skip_whitespace(char *p)
 {
     while (*p)
     {
-        if (isspace(*p))
+        if (char_class[(unsigned char)*p] & CC_SPACE)
         {
-            p++;
+            p = (char *)scan_skip_space(p);
             continue;
         }
         if (p[0] == '/' && p[1] == '/')
         {
-            p += 2;
-            while (*p && *p != '\n')
-                p++;
+            p = (char *)scan_line_end(p + 2);
             continue;
         }
         if (p[0] == '/' && p[1] == '*')
         {
-            p += 2;
-            while (*p && !(p[0] == '*' && p[1] == '/'))
-                p++;
-            if (*p)
-            p += 2;
+            p = (char *)scan_comment_end(p + 2);
             continue;
         }
         break;
@@ -163,130 +423,43 @@ static char *skip_whitespace(char *p)
     return p;
 }
 
-// File inclusion guards
-#define MAX_INCLUDED_FILES 128
-static char *included_files[MAX_INCLUDED_FILES];
-static int included_file_count;
-static bool is_file_included(const char *fn)
+// Lexes one token at lx->p into tok, skipping whitespace and comments. At
+// the end of input tok becomes a TK_EOF token.
+static void lex_token(Lexer *lx, Token *tok)
 {
-    for (int i = 0; i < included_file_count; i++)
-        if (!strcmp(included_files[i], fn))
-            return true;
-    return false;
-}
-static void add_included_file(const char *fn)
-{
-    if (included_file_count < MAX_INCLUDED_FILES)
-        included_files[included_file_count++] = strdup(fn);
-}
-
-static char *resolve_include_path(const char *incfile, const char *fn)
-{
-    if (fn[0] == '/' || (fn[1] == ':' && fn[2] == '\\'))
-        return strdup(fn);
-    char *dir = strdup(incfile);
-    char *s = strrchr(dir, '/');
-    if (!s)
-        s = strrchr(dir, '\\');
-    if (s)
-        *(s + 1) = 0;
-    else
-        dir[0] = 0;
-    char *res = malloc(strlen(dir) + strlen(fn) + 1);
-    sprintf(res, "%s%s", dir, fn);
-    free(dir);
-    return res;
-}
-
-// Tokenizer entry
-Token *tokenize(char *p)
-{
-    fprintf(stderr, "[DEBUG] Entering tokenize()\n");
-    Token head = {0}, *cur = &head;
-    const char *file = "<input>";
-    int line = 1, col = 1;
-    int token_count = 0;
+    char *p = lx->p;
     while (*p)
     {
-        if (++token_count > 1000000)
-        {
-            error("Tokenizer recursion or token overflow");
-            break;
-        }
-        // Skip lines where the first non-whitespace character is '#'
-        char *line_start = p;
-        while (*p == ' ' || *p == '\t')
-            p++;
-        if (*p == '#')
-        {
-            while (*p && *p != '\n' && *p != '\r')
-                p++;
-            if (*p == '\r' && *(p + 1) == '\n')
-            {
-                p += 2;
-                line++;
-                col = 1;
-            }
-            else if (*p == '\n' || *p == '\r')
-            {
-                p++;
-                line++;
-                col = 1;
-            }
-            continue;
-        }
-        p = line_start; // Reset p to start of line for normal tokenization
-        fprintf(stderr, "[DEBUG] Top of while(*p) loop, char='%c'\n", *p);
-        char *old_p = p;
+        TRACE(TRACE_LEX, 2, "top of loop, char='%c'", *p);
         p = skip_whitespace(p);
-        col += (int)(p - old_p);
         if (!*p)
             break;
-        // Multi-letter punctuators
-        if (strncmp(p, "==", 2) == 0 || strncmp(p, "!=", 2) == 0 ||
-            strncmp(p, "<=", 2) == 0 || strncmp(p, ">=", 2) == 0 ||
-            strncmp(p, "+=", 2) == 0 || strncmp(p, "-=", 2) == 0 ||
-            strncmp(p, "*=", 2) == 0 || strncmp(p, "/=", 2) == 0 ||
-            strncmp(p, "++", 2) == 0 || strncmp(p, "--", 2) == 0 ||
-            strncmp(p, "&&", 2) == 0 || strncmp(p, "||", 2) == 0 ||
-            strncmp(p, "<<", 2) == 0 || strncmp(p, ">>", 2) == 0)
-        {
-            cur = new_token(TK_RESERVED, cur, p, 2, file, line, col);
-            p += 2;
-            col += 2;
-            continue;
-        }
-        // Single-letter punctuators
-        if (strchr("+-*/()<>=;{},&[].|^~?:!%", *p))
+        // Punctuators
+        int punct_len = read_punct(p);
+        if (punct_len)
         {
-            cur = new_token(TK_RESERVED, cur, p, 1, file, line, col);
-            p++;
-            col++;
-            continue;
+            new_token(tok, TK_RESERVED, p, punct_len, lx->file);
+            p += punct_len;
+            goto done;
         }
         // Numeric literals
         if (isdigit(*p))
         {
             char *q = p;
-            int tok_col = col;
             long val = strtol(p, &p, 10);
-            cur = new_token(TK_NUM, cur, q, p - q, file, line, tok_col);
-            cur->val = val;
-            col += (int)(p - q);
-            continue;
+            new_token(tok, TK_NUM, q, p - q, lx->file);
+            tok->val = val;
+            goto done;
         }
         // Char literals
         if (*p == '\'')
         {
             char *start = p;
-            int tok_col = col;
             p++;
-            col++;
             int c;
             if (*p == '\\')
             {
                 p++;
-                col++;
                 switch (*p)
                 {
                 case 'n':
@@ -311,95 +484,380 @@ Token *tokenize(char *p)
                     c = '\\';
                     break;
                 default:
-                    error_at(token, "unknown escape sequence: \\%c", *p);
+                    LEX_ERROR(lx, "unknown escape sequence: \\%c", *p);
                 }
                 p++;
-                col++;
             }
             else if (*p)
             {
                 c = *p;
                 p++;
-                col++;
             }
             else
             {
-                error_at(token, "unterminated char literal");
+                LEX_ERROR(lx, "unterminated char literal");
             }
             if (*p != '\'')
-                error_at(token, "unterminated char literal");
+                LEX_ERROR(lx, "unterminated char literal");
             p++;
-            col++;
-            cur = new_token(TK_NUM, cur, start, p - start, file, line, tok_col);
-            cur->val = c;
-            continue;
+            new_token(tok, TK_NUM, start, p - start, lx->file);
+            tok->val = c;
+            goto done;
         }
         // Identifiers/keywords
         if (is_ident1(*p))
         {
             char *start = p;
-            int tok_col = col;
-            do
-            {
-                p++;
-                col++;
-            } while (is_ident2(*p));
+            p = (char *)scan_ident_end(p + 1);
             int len = p - start;
-            if (is_keyword(start, len))
-                cur = new_token(TK_KEYWORD, cur, start, len, file, line, tok_col);
+            KeywordKind kw = keyword_id(start, len);
+            if (kw != KW_NONE)
+            {
+                new_token(tok, TK_KEYWORD, start, len, lx->file);
+                tok->val = kw;
+            }
             else
-                cur = new_token(TK_IDENT, cur, start, len, file, line, tok_col);
-            continue;
+            {
+                new_token(tok, TK_IDENT, start, len, lx->file);
+                if (!lx->ahead)
+                    tok->name = intern(start, len);
+            }
+            goto done;
         }
         // String literal
         if (*p == '"')
         {
-            int tok_col = col;
             p++;
-            col++;
             char *str = p;
-            while (*p && *p != '"')
+            for (;;)
             {
-                if (*p == '\n')
+                p = (char *)scan_string_end(p);
+                if (*p == '\\' && p[1])
                 {
-                    line++;
-                    col = 1;
+                    p += 2;
+                    continue;
                 }
-                else
-                    col++;
+                if (*p != '\n')
+                    break;
                 p++;
             }
             if (*p != '"')
-                error_at(token, "unterminated string literal");
-            cur = new_token(TK_STR, cur, str, p - str, file, line, tok_col);
+                LEX_ERROR(lx, "unterminated string literal");
+            new_token(tok, TK_STR, str, p - str, lx->file);
             p++;
-            col++;
-            continue;
+            goto done;
         }
         // Newline
         if (*p == '\n')
         {
             p++;
-            line++;
-            col = 1;
             continue;
         }
+        // Directive introducer, left to the preprocessor
+        if (*p == '#')
+        {
+            new_token(tok, TK_RESERVED, p, 1, lx->file);
+            p++;
+            goto done;
+        }
         // Unknown char
-        error_at(token, "invalid token");
+        LEX_ERROR(lx, "invalid token");
         p++;
-        col++;
     }
-    new_token(TK_EOF, cur, p, 0, file, line, col);
-    // Debug: print the first 10 tokens at the end of tokenization
-    Token *dbg = head.next;
-    int dbg_count = 0;
-    fprintf(stderr, "[TOKENIZER DEBUG] First tokens:\n");
-    while (dbg && dbg->kind != TK_EOF && dbg_count < 10)
+    new_token(tok, TK_EOF, p, 0, lx->file);
+done:
+    lx->p = p;
+}
+
+// Lexes the token at *p for the preprocessor and moves *p past it. '#' comes
+// back as a TK_RESERVED token rather than its line being skipped, so the
+// preprocessor can run the directive. Returns true when a line break comes
+// before the token.
+bool lex_pp_token(char **p, int file_id, Token *tok)
+{
+    if (!punct_state_count)
+        build_punct_dfa();
+    Lexer lx = {*p, file_id};
+    lex_token(&lx, tok);
+    char *start = tok->str - (tok->kind == TK_STR);
+    bool line_break = memchr(*p, '\n', start - *p) != NULL;
+    *p = lx.p;
+    return line_break;
+}
+
+// Lexing ahead
+//
+// A large file is lexed in full before the preprocessor reads it, in pieces
+// on a pool of threads. One pre-scan cuts the text at newlines outside
+// comments and literals, so each piece starts where a token may. The
+// preprocessor then takes a token from the pieces whenever it reads on from
+// the very byte that token was lexed from: lexing depends on nothing but
+// the text from there on, so it is the token lex_pp_token() would give.
+// Elsewhere (after a directive line, an inactive region or at the start of
+// a piece) it lexes one token itself and is back in step. Identifiers are
+// interned as they are taken, as the intern table is single-threaded. A
+// piece stops at its first lexing error and the rest of it is lexed as it
+// is read, so errors are only reported for text the preprocessor reads.
+#define LEX_AHEAD_MIN (1024 * 1024) // Smaller files are lexed as they are read
+#define LEX_CHUNK_MIN (128 * 1024)
+#define LEX_MAX_JOBS 64
+#define LEX_CHUNKS_PER_JOB 4 // Extra pieces even out uneven token density
+
+typedef struct
+{
+    Token tok;
+    char *from;      // Where lexing it began
+    char *to;        // Where lexing it ended
+    bool line_break; // What lex_pp_token() returns for it
+} LexedToken;
+
+typedef struct
+{
+    char *start;
+    char *end; // Start of the next piece
+    LexedToken *toks;
+    int len;
+    int cap;
+} LexChunk;
+
+struct LexAhead
+{
+    int file;
+    LexChunk *chunks;
+    int count;
+    int next;  // Next unclaimed piece, while lexing
+    int chunk; // Next token to take, by piece and position
+    int pos;
+};
+
+// Lexes the token at *p like lex_pp_token(), taking it from a when it was
+// lexed from *p
+bool lex_ahead_token(LexAhead *a, char **p, Token *tok)
+{
+    for (; a->chunk < a->count; a->chunk++, a->pos = 0)
     {
-        fprintf(stderr, "  kind=%d, str='%.*s'\n", dbg->kind, dbg->len, dbg->str);
-        dbg = dbg->next;
-        dbg_count++;
+        LexChunk *c = &a->chunks[a->chunk];
+        while (a->pos < c->len && c->toks[a->pos].from < *p)
+            a->pos++;
+        if (a->pos < c->len)
+            break;
     }
-    // After tokenization, preprocess the token list
-       return head.next;
+    if (a->chunk < a->count)
+    {
+        LexedToken *t = &a->chunks[a->chunk].toks[a->pos];
+        if (t->from == *p)
+        {
+            *tok = t->tok;
+            if (tok->kind == TK_IDENT)
+                tok->name = intern(tok->str, tok->len);
+            *p = t->to;
+            a->pos++;
+            return t->line_break;
+        }
+    }
+    return lex_pp_token(p, a->file, tok);
+}
+
+void lex_ahead_free(LexAhead *a)
+{
+    if (!a)
+        return;
+    for (int i = 0; i < a->count; i++)
+        free(a->chunks[i].toks);
+    free(a->chunks);
+    free(a);
+}
+
+#ifndef _WIN32
+// Threads worth using to lex len bytes, 1 meaning none. LAWSA_LEX_JOBS
+// overrides the number of online CPUs.
+static int lex_jobs(size_t len)
+{
+    if (len < LEX_AHEAD_MIN)
+        return 1;
+    char *env = getenv("LAWSA_LEX_JOBS");
+    long n = env ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (n > (long)(len / LEX_CHUNK_MIN))
+        n = len / LEX_CHUNK_MIN;
+    if (n > LEX_MAX_JOBS)
+        n = LEX_MAX_JOBS;
+    return n < 1 ? 1 : (int)n;
+}
+
+// Cuts the len bytes at text into at most n pieces of similar size and
+// returns how many were made. Skips literals and comments the way
+// lex_token() does.
+static int split_text(char *text, size_t len, LexChunk *chunks, int n)
+{
+    char *p = text, *end = text + len;
+    int count = 1;
+    char *target = p + len / n;
+    chunks[0].start = text;
+    while (*p && count < n)
+    {
+        p += strcspn(p, "\"'/\n");
+        switch (*p)
+        {
+        case '\n':
+            p++;
+            if (p >= target && end - p >= LEX_CHUNK_MIN / 2)
+            {
+                chunks[count - 1].end = p;
+                chunks[count++].start = p;
+                target = p + (end - p) / (n - count + 1);
+            }
+            break;
+        case '"':
+            p++;
+            for (;;)
+            {
+                p = (char *)scan_string_end(p);
+                if (*p == '\\' && p[1])
+                    p += 2;
+                else if (*p == '\n')
+                    p++;
+                else
+                    break;
+            }
+            if (*p)
+                p++;
+            break;
+        case '\'':
+            p++;
+            if (*p == '\\')
+                p++;
+            if (*p)
+                p++;
+            if (*p == '\'')
+                p++;
+            break;
+        case '/':
+            if (p[1] == '/')
+                p = (char *)scan_line_end(p + 2);
+            else if (p[1] == '*')
+                p = (char *)scan_comment_end(p + 2);
+            else
+                p++;
+            break;
+        }
+    }
+    chunks[count - 1].end = end;
+    return count;
+}
+
+// Lexes the tokens that begin in c, stopping short of the end of input and
+// of the first error
+static void lex_chunk(LexAhead *a, LexChunk *c)
+{
+    Lexer lx = {c->start, a->file, true};
+    while (lx.p < c->end)
+    {
+        if (c->len == c->cap)
+        {
+            c->cap = c->cap ? c->cap * 2 : 1024;
+            c->toks = realloc(c->toks, sizeof(LexedToken) * c->cap);
+        }
+        LexedToken *t = &c->toks[c->len];
+        t->tok = (Token){0};
+        t->from = lx.p;
+        lex_token(&lx, &t->tok);
+        if (lx.failed || t->tok.kind == TK_EOF)
+            break;
+        t->to = lx.p;
+        char *start = t->tok.str - (t->tok.kind == TK_STR);
+        t->line_break = memchr(t->from, '\n', start - t->from) != NULL;
+        c->len++;
+    }
+}
+
+static void *lex_worker(void *arg)
+{
+    LexAhead *a = arg;
+    int i;
+    while ((i = __atomic_fetch_add(&a->next, 1, __ATOMIC_RELAXED)) < a->count)
+        lex_chunk(a, &a->chunks[i]);
+    return NULL;
+}
+#endif
+
+// Lexes the len bytes of a file's text ahead of the preprocessor, if it is
+// large enough to be worth the threads. Returns NULL otherwise.
+LexAhead *lex_ahead(char *text, size_t len, int file_id)
+{
+#ifdef _WIN32
+    return NULL;
+#else
+    int jobs = lex_jobs(len);
+    if (jobs < 2)
+        return NULL;
+    int n = jobs * LEX_CHUNKS_PER_JOB;
+    if ((size_t)n > len / LEX_CHUNK_MIN)
+        n = len / LEX_CHUNK_MIN;
+    LexAhead *a = calloc(1, sizeof(LexAhead));
+    a->file = file_id;
+    a->chunks = calloc(n, sizeof(LexChunk));
+    a->count = split_text(text, len, a->chunks, n);
+    TRACE(TRACE_LEX, 1, "lexing %s ahead in %d pieces on %d threads", source_file_name(file_id), a->count, jobs);
+
+    // The threads share the punctuator DFA and the scanner, which are both
+    // set up on first use
+    if (!punct_state_count)
+        build_punct_dfa();
+    scan_skip_space(text);
+
+    // The calling thread takes pieces too
+    pthread_t threads[LEX_MAX_JOBS];
+    int started = 0;
+    while (started < jobs - 1 && pthread_create(&threads[started], NULL, lex_worker, a) == 0)
+        started++;
+    lex_worker(a);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    return a;
+#endif
+}
+
+// On-demand tokenization
+// A lazy stream produces nothing up front. Tokens are produced one at a time
+// as next_token() walks past the newest one, into a fixed ring of slots, so
+// memory stays flat whatever the input size. A token stays valid until
+// TOKEN_WINDOW newer tokens have been produced; the parser only holds
+// tokens for a few lookaheads and rewinds.
+static Token *pull_token(void)
+{
+    Token *tok = &token_window[token_window_pos++ % TOKEN_WINDOW];
+    memset(tok, 0, sizeof(*tok));
+    lazy_source(tok);
+    return tok;
+}
+
+// Starts a stream whose tokens come from produce, which fills in one token
+// per call and a TK_EOF token at the end. An eager stream is produced in
+// full into the token arena, so its tokens stay put until free_tokens();
+// otherwise tokens are produced on demand into the window.
+Token *token_stream(TokenProducer *produce, bool eager)
+{
+    if (eager)
+    {
+        Token head = {0}, *cur = &head;
+        do
+        {
+            cur = cur->next = arena_alloc(&token_arena, sizeof(Token));
+            produce(cur);
+        } while (cur->kind != TK_EOF);
+        return head.next;
+    }
+    if (!token_window)
+        token_window = malloc(sizeof(Token) * TOKEN_WINDOW);
+    lazy_source = produce;
+    token_window_pos = 0;
+    return pull_token();
+}
+
+// Returns the token after tok, producing it first if tok is the newest one
+Token *next_token(Token *tok)
+{
+    if (!tok->next && lazy_source && tok->kind != TK_EOF)
+        tok->next = pull_token();
+    return tok->next;
 }
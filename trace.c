@@ -0,0 +1,76 @@
+// trace.c - Leveled debug tracing by subsystem
+//
+// Each category has a level, 0 (off) by default. Level 1 traces phase
+// milestones, level 2 adds a line per token, source line, statement or
+// instruction. Levels are set from the LAWSA_TRACE environment variable at
+// startup, or with --trace / -d on the command line, using a spec such as
+// "lex=2,parse" or "all". Building with -DNDEBUG removes every TRACE() call.
+#include "lawsa.h"
+
+#define TRACE_LINE_MAX 4096
+
+int trace_levels[TRACE_NCAT];
+
+static const char *trace_names[TRACE_NCAT] = {
+    [TRACE_DRIVER] = "driver",
+    [TRACE_LEX] = "lex",
+    [TRACE_PP] = "pp",
+    [TRACE_PARSE] = "parse",
+    [TRACE_CODEGEN] = "codegen",
+    [TRACE_PEEPHOLE] = "peephole",
+};
+
+// Applies a comma-separated list of "category[=level]" items. A bare
+// category means level 1; "all" names every category.
+void trace_enable(const char *spec)
+{
+    const char *p = spec;
+    while (*p)
+    {
+        int len = strcspn(p, ",=");
+        int level = 1;
+        const char *next = p + len;
+        if (*next == '=')
+        {
+            level = atoi(next + 1);
+            next += 1 + strcspn(next + 1, ",");
+        }
+        bool found = false;
+        for (int i = 0; i < TRACE_NCAT; i++)
+        {
+            bool all = len == 3 && !strncmp(p, "all", 3);
+            if (all || ((int)strlen(trace_names[i]) == len && !strncmp(p, trace_names[i], len)))
+            {
+                trace_levels[i] = level;
+                found = true;
+            }
+        }
+        if (!found && len)
+            fprintf(stderr, "trace: unknown category '%.*s'\n", len, p);
+        p = *next ? next + 1 : next;
+    }
+}
+
+// Runs ahead of the other constructors so they can trace too
+__attribute__((constructor(101))) static void trace_from_env(void)
+{
+    const char *spec = getenv("LAWSA_TRACE");
+    if (spec)
+        trace_enable(spec);
+}
+
+// Writes one trace line, tagged with its category. The line goes out in a
+// single write so lines from the threads of lex_ahead() do not interleave;
+// overlong lines are cut short.
+void trace_print(TraceCategory cat, const char *fmt, ...)
+{
+    char buf[TRACE_LINE_MAX];
+    int n = snprintf(buf, sizeof(buf) - 1, "[%s] ", trace_names[cat]);
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(buf + n, sizeof(buf) - 1 - n, fmt, ap);
+    va_end(ap);
+    n = len < 0 || n + len > (int)sizeof(buf) - 2 ? (int)sizeof(buf) - 2 : n + len;
+    buf[n++] = '\n';
+    fwrite(buf, 1, n, stderr);
+}
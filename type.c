@@ -1,79 +1,138 @@
 #include "lawsa.h"
 // #include "type.h" - comment out to avoid duplicate definitions
 
-Type *int_type(bool is_unsigned)
+// Builtin types are singletons, and pointer, array and function types are
+// hash-consed over their (already canonical) parts, so identical types share
+// one object and type equality is a pointer compare. Struct, union and enum
+// types stay nominal: every declaration makes a type of its own. Canonical
+// types are shared, so nothing may modify one after it is returned.
+static Type builtin_types[] = {
+    [TY_VOID] = {.kind = TY_VOID, .size = 0, .align = 1},
+    [TY_CHAR] = {.kind = TY_CHAR, .size = 1, .align = 1},
+    [TY_SHORT] = {.kind = TY_SHORT, .size = 2, .align = 2},
+    [TY_INT] = {.kind = TY_INT, .size = 4, .align = 4},
+    [TY_LONG] = {.kind = TY_LONG, .size = 8, .align = 8},
+    [TY_LONGLONG] = {.kind = TY_LONGLONG, .size = 8, .align = 8},
+    [TY_UCHAR] = {.kind = TY_UCHAR, .size = 1, .align = 1, .qualifiers.is_unsigned = true},
+    [TY_USHORT] = {.kind = TY_USHORT, .size = 2, .align = 2, .qualifiers.is_unsigned = true},
+    [TY_UINT] = {.kind = TY_UINT, .size = 4, .align = 4, .qualifiers.is_unsigned = true},
+    [TY_ULONG] = {.kind = TY_ULONG, .size = 8, .align = 8, .qualifiers.is_unsigned = true},
+    [TY_ULONGLONG] = {.kind = TY_ULONGLONG, .size = 8, .align = 8, .qualifiers.is_unsigned = true},
+    [TY_FLOAT] = {.kind = TY_FLOAT, .size = 4},
+    [TY_DOUBLE] = {.kind = TY_DOUBLE, .size = 8},
+    [TY_LONGDOUBLE] = {.kind = TY_LONGDOUBLE, .size = 16, .align = 16},
+};
+
+// Open-addressing table of the derived types made so far
+static Type **derived_types;
+static int derived_cap;
+static int derived_count;
+
+// Pointer and array types hang off ptr_to, function types off return_type
+static uint32_t derived_hash(Type *ty)
 {
-    Type *ty = calloc(1, sizeof(Type));
-    ty->kind = is_unsigned ? TY_UINT : TY_INT;
-    ty->size = 4;
-    ty->align = 4;
-    ty->qualifiers.is_unsigned = is_unsigned;
+    uint32_t h = ty->kind * 31 + hash_ptr(ty->kind == TY_FUNC ? ty->return_type : ty->ptr_to);
+    h = h * 31 + (ty->kind == TY_FUNC ? ty->param_count * 2 + ty->is_variadic : ty->array_size);
+    for (int i = 0; i < ty->param_count; i++)
+        h = h * 31 + hash_ptr(ty->params[i]);
+    return h;
+}
+
+static bool same_derived(Type *a, Type *b)
+{
+    if (a->kind != b->kind || a->ptr_to != b->ptr_to || a->array_size != b->array_size)
+        return false;
+    if (a->return_type != b->return_type || a->param_count != b->param_count || a->is_variadic != b->is_variadic)
+        return false;
+    for (int i = 0; i < a->param_count; i++)
+        if (a->params[i] != b->params[i])
+            return false;
+    return true;
+}
+
+static void derived_insert(Type **slots, int cap, Type *ty)
+{
+    uint32_t i = derived_hash(ty) & (cap - 1);
+    while (slots[i])
+        i = (i + 1) & (cap - 1);
+    slots[i] = ty;
+}
+
+// Returns the one type shaped like key, copying key the first time it is seen
+static Type *derived_type(Type *key)
+{
+    if (derived_count * 2 >= derived_cap)
+    {
+        int cap = derived_cap ? derived_cap * 2 : 256;
+        Type **slots = calloc(cap, sizeof(Type *));
+        for (int i = 0; i < derived_cap; i++)
+            if (derived_types[i])
+                derived_insert(slots, cap, derived_types[i]);
+        free(derived_types);
+        derived_types = slots;
+        derived_cap = cap;
+    }
+
+    uint32_t i = derived_hash(key) & (derived_cap - 1);
+    for (; derived_types[i]; i = (i + 1) & (derived_cap - 1))
+        if (same_derived(derived_types[i], key))
+            return derived_types[i];
+
+    Type *ty = malloc(sizeof(Type));
+    *ty = *key;
+    if (key->param_count)
+    {
+        ty->params = malloc(key->param_count * sizeof(Type *));
+        memcpy(ty->params, key->params, key->param_count * sizeof(Type *));
+    }
+    derived_types[i] = ty;
+    derived_count++;
     return ty;
 }
 
+Type *int_type(bool is_unsigned)
+{
+    return &builtin_types[is_unsigned ? TY_UINT : TY_INT];
+}
+
 Type *char_type(bool is_unsigned)
 {
-    Type *ty = calloc(1, sizeof(Type));
-    ty->kind = is_unsigned ? TY_UCHAR : TY_CHAR;
-    ty->size = 1;
-    ty->align = 1;
-    ty->qualifiers.is_unsigned = is_unsigned;
-    return ty;
+    return &builtin_types[is_unsigned ? TY_UCHAR : TY_CHAR];
 }
 
 Type *short_type(bool is_unsigned)
 {
-    Type *ty = calloc(1, sizeof(Type));
-    ty->kind = is_unsigned ? TY_USHORT : TY_SHORT;
-    ty->size = 2;
-    ty->align = 2;
-    ty->qualifiers.is_unsigned = is_unsigned;
-    return ty;
+    return &builtin_types[is_unsigned ? TY_USHORT : TY_SHORT];
 }
 
 Type *long_type(bool is_unsigned)
 {
-    Type *ty = calloc(1, sizeof(Type));
-    ty->kind = is_unsigned ? TY_ULONG : TY_LONG;
-    ty->size = 8;
-    ty->align = 8;
-    ty->qualifiers.is_unsigned = is_unsigned;
-    return ty;
+    return &builtin_types[is_unsigned ? TY_ULONG : TY_LONG];
 }
 
 Type *longlong_type(bool is_unsigned)
 {
-    Type *ty = calloc(1, sizeof(Type));
-    ty->kind = is_unsigned ? TY_ULONGLONG : TY_LONGLONG;
-    ty->size = 8;
-    ty->align = 8;
-    ty->qualifiers.is_unsigned = is_unsigned;
-    return ty;
+    return &builtin_types[is_unsigned ? TY_ULONGLONG : TY_LONGLONG];
 }
 
 Type *float_type()
 {
-    Type *ty = calloc(1, sizeof(Type));
-    ty->kind = TY_FLOAT;
-    ty->size = 4;
-    return ty;
+    return &builtin_types[TY_FLOAT];
 }
 
 Type *double_type()
 {
-    Type *ty = calloc(1, sizeof(Type));
-    ty->kind = TY_DOUBLE;
-    ty->size = 8;
-    return ty;
+    return &builtin_types[TY_DOUBLE];
 }
 
 Type *longdouble_type()
 {
-    Type *ty = calloc(1, sizeof(Type));
-    ty->kind = TY_LONGDOUBLE;
-    ty->size = 16;
-    ty->align = 16;
-    return ty;
+    return &builtin_types[TY_LONGDOUBLE];
+}
+
+Type *void_type()
+{
+    return &builtin_types[TY_VOID];
 }
 
 Type *enum_type(const char *tag)
@@ -99,63 +158,113 @@ Type *typedef_type(char *name, Type *aliased)
 
 Type *pointer_to(Type *base)
 {
-    Type *ty = calloc(1, sizeof(Type));
-    ty->kind = TY_PTR;
-    ty->ptr_to = base;
-    ty->size = 8;
-    return ty;
+    Type key = {.kind = TY_PTR, .ptr_to = base, .size = 8};
+    return derived_type(&key);
 }
 
 Type *array_of(Type *base, int size)
 {
-    Type *ty = calloc(1, sizeof(Type));
-    ty->kind = TY_ARRAY;
-    ty->ptr_to = base;
-    ty->size = base->size * size;
-    ty->array_size = size;
-    return ty;
+    Type key = {.kind = TY_ARRAY, .ptr_to = base, .size = base->size * size, .array_size = size};
+    return derived_type(&key);
 }
 
-Type *void_type()
+// params is copied, so the caller may reuse or free it
+Type *function_type(Type *return_type, Type **params, int param_count, bool is_variadic)
 {
-    Type *ty = calloc(1, sizeof(Type));
-    ty->kind = TY_VOID;
-    ty->size = 0;
-    ty->align = 1;
-    return ty;
+    Type key = {.kind = TY_FUNC, .size = 8, // Function pointers are 8 bytes on x86-64
+                .return_type = return_type,
+                .params = params,
+                .param_count = param_count,
+                .is_variadic = is_variadic};
+    return derived_type(&key);
 }
 
-Type *function_type(Type *return_type)
+// Maps a type built outside the constructors above (e.g. loaded from a
+// precompiled header) to the canonical object of the same shape. Nominal
+// types, and anything with qualifiers the constructors never set, are
+// returned as they are.
+Type *canonical_type(Type *ty)
 {
-    Type *ty = calloc(1, sizeof(Type));
-    ty->kind = TY_FUNC;
-    ty->return_type = return_type;
-    ty->params = NULL;
-    ty->param_count = 0;
-    ty->is_variadic = false;
-    ty->size = 8; // Function pointers are 8 bytes on x86-64
-    return ty;
+    if (!ty)
+        return NULL;
+    Type *canon;
+    switch (ty->kind)
+    {
+    case TY_PTR:
+        canon = pointer_to(canonical_type(ty->ptr_to));
+        break;
+    case TY_ARRAY:
+        canon = array_of(canonical_type(ty->ptr_to), ty->array_size);
+        break;
+    case TY_FUNC:
+    {
+        Type **params = malloc((ty->param_count + 1) * sizeof(Type *));
+        for (int i = 0; i < ty->param_count; i++)
+            params[i] = canonical_type(ty->params[i]);
+        canon = function_type(canonical_type(ty->return_type), params, ty->param_count, ty->is_variadic);
+        free(params);
+        break;
+    }
+    case TY_ENUM:
+    case TY_STRUCT:
+    case TY_UNION:
+    case TY_TYPEDEF:
+        return ty;
+    default:
+        canon = &builtin_types[ty->kind];
+        break;
+    }
+    if (memcmp(&ty->qualifiers, &canon->qualifiers, sizeof(TypeQualifiers)) != 0)
+        return ty;
+    return canon;
 }
 
-void add_param_type(Type *func, Type *param)
+// Aggregates with fewer members than this are searched by walking the list
+#define MEMBER_INDEX_MIN 8
+
+// Counts a struct or union's members and, for wide ones, builds an
+// open-addressing table from interned name to member. Called once the
+// member list is complete; the first member of a name wins, as in the list.
+void index_members(Type *ty)
 {
-    if (func->kind != TY_FUNC)
+    ty->member_count = 0;
+    for (Member *mem = ty->members; mem; mem = mem->next)
+        ty->member_count++;
+    if (ty->member_count < MEMBER_INDEX_MIN)
         return;
 
-    // Allocate or resize parameter array
-    if (func->params == NULL)
+    int cap = 16;
+    while (cap < ty->member_count * 2)
+        cap *= 2;
+    ty->member_index = calloc(cap, sizeof(Member *));
+    ty->member_index_cap = cap;
+    for (Member *mem = ty->members; mem; mem = mem->next)
     {
-        func->params = calloc(8, sizeof(Type *)); // Start with 8 slots
+        if (!mem->name)
+            continue;
+        uint32_t i = hash_ptr(mem->name) & (cap - 1);
+        while (ty->member_index[i] && ty->member_index[i]->name != mem->name)
+            i = (i + 1) & (cap - 1);
+        if (!ty->member_index[i])
+            ty->member_index[i] = mem;
     }
-    else if (func->param_count % 8 == 0)
+}
+
+// Finds a member by interned name, or returns NULL
+Member *find_member(Type *ty, const char *name)
+{
+    if (!ty->member_index)
     {
-        // Double capacity when needed
-        size_t new_size = (func->param_count + 8) * sizeof(Type *);
-        func->params = realloc(func->params, new_size);
+        for (Member *mem = ty->members; mem; mem = mem->next)
+            if (mem->name == name)
+                return mem;
+        return NULL;
     }
-
-    // Add parameter
-    func->params[func->param_count++] = param;
+    uint32_t mask = ty->member_index_cap - 1;
+    for (uint32_t i = hash_ptr(name) & mask; ty->member_index[i]; i = (i + 1) & mask)
+        if (ty->member_index[i]->name == name)
+            return ty->member_index[i];
+    return NULL;
 }
 
 /* Remove this duplicate function
@@ -200,6 +309,9 @@ bool is_compatible(Type *a, Type *b)
     // Disallow assignment to const (if tracked)
     if (a->qualifiers.is_const)
         return false;
+    // Identical types are one object
+    if (a == b)
+        return true;
     // Struct/union: must be the same type (pointer equality)
     if ((a->kind == TY_STRUCT || a->kind == TY_UNION) && (b->kind == TY_STRUCT || b->kind == TY_UNION))
         return a == b;
@@ -220,7 +332,8 @@ bool is_compatible(Type *a, Type *b)
     if ((a->kind == TY_PTR && a->ptr_to && a->ptr_to->kind == TY_CHAR && a->qualifiers.is_const) ||
         (b->kind == TY_PTR && b->ptr_to && b->ptr_to->kind == TY_CHAR && b->qualifiers.is_const))
         return false;
-    // Function pointers: must match signature
+    // Function pointers: must match signature, which canonical types
+    // reduce to identity
     if (a->kind == TY_FUNC && b->kind == TY_FUNC)
         return a == b;
     return false;
@@ -55,12 +55,14 @@ struct Type
     // Struct/Union
     struct Member *members;
     int member_count;
+    struct Member **member_index; // Hashed by name, see index_members()
+    int member_index_cap;
     char *tag; // Struct/union tag name
 
     // Enum
     struct EnumConst *enum_consts;
     int enum_const_count;
-    char *enum_tag;
+    const char *enum_tag;
 
     // Typedef
     char *typedef_name;
@@ -82,7 +84,7 @@ struct Member
 {
     Member *next;
     Type *ty;
-    char *name;
+    const char *name; // Interned
     int offset;
     int bit_width;  // For bitfields
     int bit_offset; // For bitfields
@@ -103,11 +105,15 @@ Type *char_type(bool is_unsigned);
 Type *void_type();
 Type *pointer_to(Type *base);
 Type *array_of(Type *base, int size);
-Type *function_type(Type *return_type);
+Type *function_type(Type *return_type, Type **params, int param_count, bool is_variadic);
+Type *short_type(bool is_unsigned);
 Type *long_type(bool is_unsigned);
+Type *longlong_type(bool is_unsigned);
 Type *longdouble_type();
 Type *enum_type(const char *tag);
-void add_param_type(Type *func, Type *param);
+Type *canonical_type(Type *ty);
+void index_members(Type *ty);
+struct Member *find_member(Type *ty, const char *name);
 bool is_compatible(Type *a, Type *b);
 bool is_integer_type(Type *ty);
 int size_of(Type *ty);
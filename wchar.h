@@ -1,6 +1,8 @@
 #ifndef _WCHAR_H
 #define _WCHAR_H
 
+#include <stddef.h>
+
 typedef long wchar_t;
 
 typedef struct